@@ -44,6 +44,26 @@ static void __make_cq_entry(int eid, u16 ret)
 /***
  * Queue managements
  */
+static void __reset_dbbuf(int dbs_idx)
+{
+	if (!nvmev_vdev->dbbuf_dbs)
+		return;
+
+	nvmev_vdev->dbbuf_dbs[dbs_idx] = 0;
+	nvmev_vdev->dbbuf_eis[dbs_idx] = -1;
+}
+
+/* Let the dispatcher in charge of @qid poll its doorbells while it is alive */
+static void __update_io_queues(unsigned int qid)
+{
+	unsigned long *io_queues = nvmev_vdev->dispatchers[nvmev_get_dispatcher(qid)].io_queues;
+
+	if (nvmev_vdev->sqes[qid] || nvmev_vdev->cqes[qid])
+		set_bit(qid, io_queues);
+	else
+		clear_bit(qid, io_queues);
+}
+
 static void __nvmev_admin_create_cq(int eid)
 {
 	struct nvmev_admin_queue *queue = nvmev_vdev->admin_q;
@@ -81,10 +101,13 @@ static void __nvmev_admin_create_cq(int eid)
 		cq->cq[i] = prp_address_offset(cmd->prp1, i);
 	}
 
-	nvmev_vdev->cqes[cq->qid] = cq;
-
 	dbs_idx = cq->qid * 2 + 1;
 	nvmev_vdev->dbs[dbs_idx] = nvmev_vdev->old_dbs[dbs_idx] = 0;
+	__reset_dbbuf(dbs_idx);
+
+	smp_wmb(); /* Other dispatchers shall see the reset doorbell first */
+	nvmev_vdev->cqes[cq->qid] = cq;
+	__update_io_queues(cq->qid);
 
 	__make_cq_entry(eid, NVME_SC_SUCCESS);
 }
@@ -98,7 +121,15 @@ static void __nvmev_admin_delete_cq(int eid)
 	qid = sq_entry(eid).delete_queue.qid;
 
 	cq = nvmev_vdev->cqes[qid];
-	nvmev_vdev->cqes[qid] = NULL;
+	WRITE_ONCE(nvmev_vdev->cqes[qid], NULL);
+	__update_io_queues(qid);
+
+	/*
+	 * The io workers post completions and interrupts to the CQ, and the
+	 * dispatcher of the CQ may still be consuming its doorbell.
+	 */
+	nvmev_quiesce_dispatchers();
+	nvmev_quiesce_io_workers();
 
 	if (cq) {
 		kfree(cq->cq);
@@ -121,7 +152,7 @@ static void __nvmev_admin_create_sq(int eid)
 	sq->qid = cmd->sqid;
 	sq->cqid = cmd->cqid;
 
-	sq->priority = cmd->sq_flags & 0xFFFE;
+	sq->priority = (cmd->sq_flags >> 1) & 0x3; /* QPRIO */
 	sq->queue_size = cmd->qsize + 1;
 
 	/* TODO Physically non-contiguous prp list */
@@ -134,11 +165,14 @@ static void __nvmev_admin_create_sq(int eid)
 	for (i = 0; i < num_pages; i++) {
 		sq->sq[i] = prp_address_offset(cmd->prp1, i);
 	}
-	nvmev_vdev->sqes[sq->qid] = sq;
-
 	dbs_idx = sq->qid * 2;
 	nvmev_vdev->dbs[dbs_idx] = 0;
 	nvmev_vdev->old_dbs[dbs_idx] = 0;
+	__reset_dbbuf(dbs_idx);
+
+	smp_wmb(); /* Other dispatchers shall see the reset doorbell first */
+	nvmev_vdev->sqes[sq->qid] = sq;
+	__update_io_queues(sq->qid);
 
 	__make_cq_entry(eid, NVME_SC_SUCCESS);
 }
@@ -153,7 +187,11 @@ static void __nvmev_admin_delete_sq(int eid)
 	qid = cmd->qid;
 
 	sq = nvmev_vdev->sqes[qid];
-	nvmev_vdev->sqes[qid] = NULL;
+	WRITE_ONCE(nvmev_vdev->sqes[qid], NULL);
+	__update_io_queues(qid);
+
+	/* The dispatcher of the SQ may still be fetching from it */
+	nvmev_quiesce_dispatchers();
 
 	if (sq) {
 		kfree(sq->sq);
@@ -164,6 +202,45 @@ static void __nvmev_admin_delete_sq(int eid)
 }
 
 
+/***
+ * Doorbell buffer config
+ */
+static void __nvmev_admin_dbbuf(int eid)
+{
+	struct nvmev_admin_queue *queue = nvmev_vdev->admin_q;
+	struct nvme_dbbuf *cmd = &sq_entry(eid).dbbuf;
+	u32 *dbs, *eis;
+	int qid;
+
+	if (!cmd->prp1 || !cmd->prp2 || (cmd->prp1 & ~PAGE_MASK) || (cmd->prp2 & ~PAGE_MASK)) {
+		__make_cq_entry(eid, NVME_SC_INVALID_FIELD);
+		return;
+	}
+
+	dbs = prp_address(cmd->prp1);
+	eis = prp_address(cmd->prp2);
+
+	/*
+	 * Carry over the doorbells of the I/O queues created so far. The admin
+	 * queue keeps using the MMIO doorbells as the host does not shadow them.
+	 */
+	for (qid = 1; qid <= NR_MAX_IO_QUEUE; qid++) {
+		int dbs_idx = qid * 2;
+
+		dbs[dbs_idx] = nvmev_vdev->dbs[dbs_idx];
+		eis[dbs_idx] = nvmev_vdev->old_dbs[dbs_idx] - 1;
+		dbs[dbs_idx + 1] = nvmev_vdev->dbs[dbs_idx + 1];
+		eis[dbs_idx + 1] = nvmev_vdev->old_dbs[dbs_idx + 1] - 1;
+	}
+
+	WRITE_ONCE(nvmev_vdev->dbbuf_eis, eis);
+	smp_store_release(&nvmev_vdev->dbbuf_dbs, dbs);
+
+	NVMEV_INFO("Doorbell buffer at %#llx, EventIdx at %#llx\n", cmd->prp1, cmd->prp2);
+
+	__make_cq_entry(eid, NVME_SC_SUCCESS);
+}
+
 /***
  * Log pages
  */
@@ -414,7 +491,9 @@ static void __nvmev_admin_identify_ctrl(int eid)
 	snprintf(ctrl->sn, sizeof(ctrl->sn), "CSL_Virt_SN_%02d", 1);
 	snprintf(ctrl->mn, sizeof(ctrl->mn), "CSL_Virt_MN_%02d", 1);
 	snprintf(ctrl->fr, sizeof(ctrl->fr), "CSL_%03d", 2);
+	ctrl->oacs = NVME_CTRL_OACS_DBBUF_SUPP;
 	ctrl->mdts = nvmev_vdev->mdts;
+	ctrl->sgls = 0x1 | (1 << 16); /* SGLs without alignment, bit bucket descriptors */
 	ctrl->sqes = 0x66;
 	ctrl->cqes = 0x44;
 
@@ -461,9 +540,15 @@ static void __nvmev_admin_set_features(int eid)
 	struct nvme_features *cmd = &sq_entry(eid).features;
 	__le32 result0 = 0;
 	__le32 result1 = 0;
+	u16 status = NVME_SC_SUCCESS;
 
 	switch (cmd->fid) {
 	case NVME_FEAT_ARBITRATION:
+		nvmev_vdev->arb_burst = cmd->dword11 & 0x7;
+		nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_LOW] = (cmd->dword11 >> 8) & 0xFF;
+		nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_MEDIUM] = (cmd->dword11 >> 16) & 0xFF;
+		nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_HIGH] = (cmd->dword11 >> 24) & 0xFF;
+		break;
 	case NVME_FEAT_POWER_MGMT:
 	case NVME_FEAT_LBA_RANGE:
 	case NVME_FEAT_TEMP_THRESH:
@@ -485,7 +570,23 @@ static void __nvmev_admin_set_features(int eid)
 		break;
 	}
 	case NVME_FEAT_IRQ_COALESCE:
-	case NVME_FEAT_IRQ_CONFIG:
+		nvmev_vdev->irq_coalesce_thr = cmd->dword11 & 0xFF;
+		nvmev_vdev->irq_coalesce_time = (cmd->dword11 >> 8) & 0xFF;
+		break;
+	case NVME_FEAT_IRQ_CONFIG: {
+		unsigned int iv = cmd->dword11 & 0xFFFF;
+
+		if (iv > NR_MAX_IO_QUEUE) {
+			status = NVME_SC_INVALID_FIELD;
+			break;
+		}
+
+		if (cmd->dword11 & (1 << 16)) // Coalescing Disable
+			set_bit(iv, nvmev_vdev->irq_coalesce_disabled);
+		else
+			clear_bit(iv, nvmev_vdev->irq_coalesce_disabled);
+		break;
+	}
 	case NVME_FEAT_WRITE_ATOMIC:
 	case NVME_FEAT_ASYNC_EVENT:
 	case NVME_FEAT_AUTO_PST:
@@ -497,7 +598,7 @@ static void __nvmev_admin_set_features(int eid)
 		break;
 	}
 
-	__make_cq_entry_results(eid, NVME_SC_SUCCESS, result0, result1);
+	__make_cq_entry_results(eid, status, result0, result1);
 }
 
 static void __nvmev_admin_get_features(int eid)
@@ -509,6 +610,10 @@ static void __nvmev_admin_get_features(int eid)
 
 	switch (cmd->fid) {
 	case NVME_FEAT_ARBITRATION:
+		result0 = nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_HIGH] << 24 |
+			  nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_MEDIUM] << 16 |
+			  nvmev_vdev->arb_weights[NVMEV_SQ_PRIO_LOW] << 8 | nvmev_vdev->arb_burst;
+		break;
 	case NVME_FEAT_POWER_MGMT:
 	case NVME_FEAT_LBA_RANGE:
 	case NVME_FEAT_TEMP_THRESH:
@@ -519,7 +624,16 @@ static void __nvmev_admin_get_features(int eid)
 		result0 = ((nvmev_vdev->nr_cq - 1) << 16 | (nvmev_vdev->nr_sq - 1));
 		break;
 	case NVME_FEAT_IRQ_COALESCE:
-	case NVME_FEAT_IRQ_CONFIG:
+		result0 = nvmev_vdev->irq_coalesce_time << 8 | nvmev_vdev->irq_coalesce_thr;
+		break;
+	case NVME_FEAT_IRQ_CONFIG: {
+		unsigned int iv = cmd->dword11 & 0xFFFF;
+
+		result0 = iv;
+		if (iv <= NR_MAX_IO_QUEUE && test_bit(iv, nvmev_vdev->irq_coalesce_disabled))
+			result0 |= (1 << 16);
+		break;
+	}
 	case NVME_FEAT_WRITE_ATOMIC:
 	case NVME_FEAT_ASYNC_EVENT:
 	case NVME_FEAT_AUTO_PST:
@@ -583,6 +697,9 @@ static void __nvmev_proc_admin_req(int entry_id)
 	case nvme_admin_async_event:
 		__nvmev_admin_async_event(entry_id);
 		break;
+	case nvme_admin_dbbuf:
+		__nvmev_admin_dbbuf(entry_id);
+		break;
 	case nvme_admin_activate_fw:
 	case nvme_admin_download_fw:
 	case nvme_admin_format_nvm:
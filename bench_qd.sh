@@ -0,0 +1,43 @@
+#!/bin/bash
+# Random 4 KiB read IOPS of an NVMeVirt device at QD 1, 32, and 1024.
+#
+# Load the module built from each commit to compare, then run, e.g.,
+#   sudo ./bench_qd.sh /dev/nvme1n1 | tee iops-$(git rev-parse --short HEAD).txt
+#
+# Keep the module parameters (cpus, memmap_*) and the SSD model the same
+# between the runs, as the numbers only compare with each other. The last
+# line is a row for the results table in README.md, labeled with $LABEL.
+
+DEV=${1:-/dev/nvme0n1}
+RUNTIME=${RUNTIME:-30}
+ENGINE=${ENGINE:-io_uring}
+LABEL=${LABEL:-$(git rev-parse --short HEAD 2>/dev/null)}
+
+if [ ! -b "$DEV" ]; then
+	echo "$DEV is not a block device" >&2
+	exit 1
+fi
+
+row="| $LABEL |"
+
+# QD 1024 is spread over 4 jobs to keep a single submitting core from capping it
+for qd in 1 32 1024; do
+	if [ $qd -gt 256 ]; then
+		jobs=$((qd / 256))
+		depth=256
+	else
+		jobs=1
+		depth=$qd
+	fi
+
+	# Field 8 of the terse output is the read IOPS
+	iops=$(fio --name=qd$qd --filename="$DEV" --ioengine="$ENGINE" --direct=1 \
+		--rw=randread --bs=4k --iodepth=$depth --numjobs=$jobs --group_reporting \
+		--time_based --runtime="$RUNTIME" --ramp_time=5 --norandommap \
+		--output-format=terse --terse-version=3 | cut -d ';' -f 8)
+
+	echo "QD $qd: $iops IOPS"
+	row="$row $iops |"
+done
+
+echo "$row"
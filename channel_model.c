@@ -8,11 +8,6 @@
 #include "nvmev.h"
 #include "channel_model.h"
 
-static inline unsigned long long __get_wallclock(void)
-{
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
-}
-
 void chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/)
 {
 	ch->head = 0;
@@ -30,7 +25,7 @@ void chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/)
 
 uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length)
 {
-	uint64_t cur_time = __get_wallclock();
+	uint64_t cur_time = nvmev_get_clock();
 	uint32_t pos, next_pos;
 	uint32_t remaining_credits, consumed_credits;
 	uint32_t default_delay, delay = 0;
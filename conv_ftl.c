@@ -373,8 +373,7 @@ static void conv_init_params(struct convparams *cpp)
 	cpp->pba_pcent = (int)((1 + cpp->op_area_pcent) * 100);
 }
 
-void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-			 uint32_t cpu_nr_dispatcher)
+void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr)
 {
 	struct ssdparams spp;
 	struct convparams cpp;
@@ -390,7 +389,7 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 
 	for (i = 0; i < nr_parts; i++) {
 		ssd = kmalloc(sizeof(struct ssd), GFP_KERNEL);
-		ssd_init(ssd, &spp, cpu_nr_dispatcher);
+		ssd_init(ssd, &spp);
 		conv_init_ftl(&conv_ftls[i], &cpp, ssd);
 	}
 
@@ -398,6 +397,7 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 	for (i = 1; i < nr_parts; i++) {
 		kfree(conv_ftls[i].ssd->pcie->perf_model);
 		kfree(conv_ftls[i].ssd->pcie);
+		buffer_free(conv_ftls[i].ssd->write_buffer);
 		kfree(conv_ftls[i].ssd->write_buffer);
 
 		conv_ftls[i].ssd->pcie = conv_ftls[0].ssd->pcie;
@@ -962,8 +962,11 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 	}
 
 	allocated_buf_size = buffer_allocate(wbuf, LBA_TO_BYTE(nr_lba));
-	if (allocated_buf_size < LBA_TO_BYTE(nr_lba))
+	if (allocated_buf_size < LBA_TO_BYTE(nr_lba)) {
+		ret->wait_buffer = wbuf;
+		ret->wait_size = LBA_TO_BYTE(nr_lba);
 		return false;
+	}
 
 	nsecs_latest =
 		ssd_advance_write_buffer(conv_ftl->ssd, req->nsecs_start, LBA_TO_BYTE(nr_lba));
@@ -1007,8 +1010,7 @@ static bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 			nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &swr);
 			nsecs_latest = max(nsecs_completed, nsecs_latest);
 
-			schedule_internal_operation(req->sq_id, nsecs_completed, wbuf,
-						    spp->pgs_per_oneshotpg * spp->pgsz);
+			buffer_release_at(wbuf, spp->pgs_per_oneshotpg * spp->pgsz, nsecs_completed);
 		}
 
 		// consume_write_credit(conv_ftl);
@@ -1033,7 +1035,7 @@ static void conv_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nv
 	uint32_t i;
 	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
 
-	start = local_clock();
+	start = nvmev_get_clock();
 	latest = start;
 	for (i = 0; i < ns->nr_parts; i++) {
 		latest = max(latest, ssd_next_idle_time(conv_ftls[i].ssd));
@@ -69,8 +69,7 @@ struct conv_ftl {
 	int gc_cnt;
 };
 
-void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-			 uint32_t cpu_nr_dispatcher);
+void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr);
 
 void conv_remove_namespace(struct nvmev_ns *ns);
 
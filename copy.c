@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+
+#ifdef CONFIG_X86_64
+#include <asm/processor.h>
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#include <asm/fpu/xstate.h>
+#endif
+#endif
+
+#include "nvmev.h"
+#include "copy.h"
+
+/* Bytes copied in one kernel_fpu_begin() section, which disables preemption */
+#define COPY_FPU_CHUNK (64 << 10)
+
+/*
+ * The benchmark copies several times the LLC, so that cached stores do not
+ * get the edge they would not have on I/O streaming through the storage area.
+ */
+#define COPY_BENCH_LLC_TIMES 4
+#define COPY_BENCH_MIN_SIZE (16 << 20)
+#define COPY_BENCH_MAX_SIZE (1 << 30)
+#define COPY_BENCH_ROUNDS 3
+
+static const char *copy_engine_names[NR_NVMEV_COPY_ENGINES] = {
+	"memcpy", "nt", "avx2", "avx512",
+};
+
+static const char *copy_dir_names[NR_NVMEV_COPY_DIRS] = {
+	"read", "write",
+};
+
+static void __copy_memcpy(void *dst, const void *src, size_t size)
+{
+	memcpy(dst, src, size);
+}
+
+static void __copy_nt(void *dst, const void *src, size_t size)
+{
+	memcpy_flushcache(dst, src, size);
+
+	/* Non-temporal stores must be visible before the completion is posted */
+	wmb();
+}
+
+#ifdef CONFIG_X86_64
+/* @dst is 32-byte aligned, @size is a non-zero multiple of 128 */
+static void __copy_avx2_blocks(void *dst, const void *src, size_t size)
+{
+	asm volatile("1:\n\t"
+		     "vmovdqu 0(%[src]), %%ymm0\n\t"
+		     "vmovdqu 32(%[src]), %%ymm1\n\t"
+		     "vmovdqu 64(%[src]), %%ymm2\n\t"
+		     "vmovdqu 96(%[src]), %%ymm3\n\t"
+		     "vmovntdq %%ymm0, 0(%[dst])\n\t"
+		     "vmovntdq %%ymm1, 32(%[dst])\n\t"
+		     "vmovntdq %%ymm2, 64(%[dst])\n\t"
+		     "vmovntdq %%ymm3, 96(%[dst])\n\t"
+		     "add $128, %[src]\n\t"
+		     "add $128, %[dst]\n\t"
+		     "sub $128, %[size]\n\t"
+		     "jnz 1b\n\t"
+		     : [dst] "+r"(dst), [src] "+r"(src), [size] "+r"(size)
+		     :
+		     : "memory", "cc");
+}
+
+/* @dst is 64-byte aligned, @size is a non-zero multiple of 256 */
+static void __copy_avx512_blocks(void *dst, const void *src, size_t size)
+{
+	asm volatile("1:\n\t"
+		     "vmovdqu64 0(%[src]), %%zmm0\n\t"
+		     "vmovdqu64 64(%[src]), %%zmm1\n\t"
+		     "vmovdqu64 128(%[src]), %%zmm2\n\t"
+		     "vmovdqu64 192(%[src]), %%zmm3\n\t"
+		     "vmovntdq %%zmm0, 0(%[dst])\n\t"
+		     "vmovntdq %%zmm1, 64(%[dst])\n\t"
+		     "vmovntdq %%zmm2, 128(%[dst])\n\t"
+		     "vmovntdq %%zmm3, 192(%[dst])\n\t"
+		     "add $256, %[src]\n\t"
+		     "add $256, %[dst]\n\t"
+		     "sub $256, %[size]\n\t"
+		     "jnz 1b\n\t"
+		     : [dst] "+r"(dst), [src] "+r"(src), [size] "+r"(size)
+		     :
+		     : "memory", "cc");
+}
+
+/*
+ * Copy the bytes up to the first @align boundary of @dst and the tail with
+ * memcpy, and the blocks in between with non-temporal vector stores.
+ */
+static __always_inline void __copy_vector(void *dst, const void *src, size_t size, size_t align,
+					  size_t block,
+					  void (*copy_blocks)(void *, const void *, size_t))
+{
+	size_t head = min_t(size_t, size, (void *)PTR_ALIGN(dst, align) - dst);
+
+	if (size - head < block || !irq_fpu_usable()) {
+		__copy_nt(dst, src, size);
+		return;
+	}
+
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	while (size >= block) {
+		size_t chunk = min_t(size_t, size, COPY_FPU_CHUNK) & ~(block - 1);
+
+		kernel_fpu_begin();
+		copy_blocks(dst, src, chunk);
+		kernel_fpu_end();
+
+		dst += chunk;
+		src += chunk;
+		size -= chunk;
+	}
+
+	memcpy(dst, src, size);
+
+	/* Non-temporal stores must be visible before the completion is posted */
+	wmb();
+}
+
+static void __copy_avx2(void *dst, const void *src, size_t size)
+{
+	__copy_vector(dst, src, size, 32, 128, __copy_avx2_blocks);
+}
+
+static void __copy_avx512(void *dst, const void *src, size_t size)
+{
+	__copy_vector(dst, src, size, 64, 256, __copy_avx512_blocks);
+}
+#endif
+
+static nvmev_copy_fn copy_engine_fns[NR_NVMEV_COPY_ENGINES] = {
+	[NVMEV_COPY_MEMCPY] = __copy_memcpy,
+	[NVMEV_COPY_NT] = __copy_nt,
+#ifdef CONFIG_X86_64
+	[NVMEV_COPY_AVX2] = __copy_avx2,
+	[NVMEV_COPY_AVX512] = __copy_avx512,
+#endif
+};
+
+nvmev_copy_fn nvmev_copy_fns[NR_NVMEV_COPY_DIRS] = {
+	[NVMEV_COPY_READ] = __copy_memcpy,
+	[NVMEV_COPY_WRITE] = __copy_memcpy,
+};
+
+static bool __copy_engine_usable(int engine)
+{
+	switch (engine) {
+	case NVMEV_COPY_MEMCPY:
+	case NVMEV_COPY_NT:
+		return true;
+#ifdef CONFIG_X86_64
+	case NVMEV_COPY_AVX2:
+		return boot_cpu_has(X86_FEATURE_AVX2) &&
+		       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+	case NVMEV_COPY_AVX512:
+		return boot_cpu_has(X86_FEATURE_AVX512F) &&
+		       cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+						 XFEATURE_MASK_AVX512, NULL);
+#endif
+	default:
+		return false;
+	}
+}
+
+/* Returns the engine named @name, or -1 to pick one by benchmark */
+static int __parse_copy_engine(const char *name)
+{
+	int engine;
+
+	if (name == NULL || !strcmp(name, "auto"))
+		return -1;
+
+	for (engine = 0; engine < NR_NVMEV_COPY_ENGINES; engine++) {
+		if (!strcmp(name, copy_engine_names[engine]))
+			break;
+	}
+
+	if (engine == NR_NVMEV_COPY_ENGINES) {
+		NVMEV_ERROR("Unknown copy engine %s\n", name);
+		return -1;
+	}
+
+	if (!__copy_engine_usable(engine)) {
+		NVMEV_ERROR("Copy engine %s is not supported on this host\n", name);
+		return -1;
+	}
+
+	return engine;
+}
+
+static unsigned long long __bench_copy_engine(int engine, void *dst, const void *src, size_t size)
+{
+	unsigned long long best = U64_MAX;
+	int i;
+
+	for (i = 0; i < COPY_BENCH_ROUNDS; i++) {
+		unsigned long long nsecs = nvmev_get_host_clock();
+
+		copy_engine_fns[engine](dst, src, size);
+		best = min(best, nvmev_get_host_clock() - nsecs);
+	}
+
+	return max(best, 1ULL);
+}
+
+/*
+ * @buf holds a copy of the head of @storage, so that the benchmark of writes
+ * leaves the storage area as it was.
+ */
+static int __pick_copy_engine(int dir, void *buf, void *storage, size_t size)
+{
+	unsigned long long best = U64_MAX;
+	int best_engine = NVMEV_COPY_MEMCPY;
+	int engine;
+
+	for (engine = 0; engine < NR_NVMEV_COPY_ENGINES; engine++) {
+		unsigned long long nsecs;
+
+		if (!__copy_engine_usable(engine))
+			continue;
+
+		if (dir == NVMEV_COPY_READ)
+			nsecs = __bench_copy_engine(engine, buf, storage, size);
+		else
+			nsecs = __bench_copy_engine(engine, storage, buf, size);
+
+		NVMEV_INFO("Copy engine %s for %ss: %llu MiB/s\n", copy_engine_names[engine],
+			   copy_dir_names[dir], div64_u64((u64)size * NSEC_PER_SEC, nsecs) >> 20);
+
+		if (nsecs < best) {
+			best = nsecs;
+			best_engine = engine;
+		}
+	}
+
+	return best_engine;
+}
+
+static size_t __copy_bench_size(size_t bench_size)
+{
+	size_t llc_size = 0;
+
+	if (bench_size)
+		return bench_size;
+
+#ifdef CONFIG_X86_64
+	/* The size of the last-level cache, in KiB */
+	if (boot_cpu_data.x86_cache_size > 0)
+		llc_size = (size_t)boot_cpu_data.x86_cache_size << 10;
+#endif
+
+	return clamp_t(size_t, llc_size * COPY_BENCH_LLC_TIMES, COPY_BENCH_MIN_SIZE,
+		       COPY_BENCH_MAX_SIZE);
+}
+
+void nvmev_copy_init(const char *read_engine, const char *write_engine, void *storage,
+		     size_t storage_size, size_t bench_size)
+{
+	const char *names[NR_NVMEV_COPY_DIRS] = {
+		[NVMEV_COPY_READ] = read_engine,
+		[NVMEV_COPY_WRITE] = write_engine,
+	};
+	size_t size = min_t(size_t, storage_size, __copy_bench_size(bench_size));
+	void *buf = NULL;
+	int dir;
+
+	for (dir = 0; dir < NR_NVMEV_COPY_DIRS; dir++) {
+		int engine = __parse_copy_engine(names[dir]);
+
+		/*
+		 * The host is about to consume what it reads, so non-temporal
+		 * stores evicting it would cost more than they save here.
+		 */
+		if (engine < 0 && dir == NVMEV_COPY_READ)
+			engine = NVMEV_COPY_MEMCPY;
+
+		if (engine < 0 && storage != NULL) {
+			if (buf == NULL) {
+				NVMEV_INFO("Benchmarking the copy engines over %zu MiB\n", size >> 20);
+				buf = vmalloc(size);
+				if (buf)
+					memcpy(buf, storage, size);
+			}
+			if (buf)
+				engine = __pick_copy_engine(dir, buf, storage, size);
+		}
+
+		if (engine < 0)
+			engine = NVMEV_COPY_MEMCPY;
+
+		nvmev_copy_fns[dir] = copy_engine_fns[engine];
+		NVMEV_INFO("Copy engine for %ss: %s\n", copy_dir_names[dir], copy_engine_names[engine]);
+	}
+
+	vfree(buf);
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _LIB_NVMEV_COPY_H
+#define _LIB_NVMEV_COPY_H
+
+/* Directions of the data copies between the host and the storage area */
+enum {
+	NVMEV_COPY_READ = 0, /* storage -> host */
+	NVMEV_COPY_WRITE, /* host -> storage */
+	NR_NVMEV_COPY_DIRS,
+};
+
+enum {
+	NVMEV_COPY_MEMCPY = 0,
+	NVMEV_COPY_NT, /* non-temporal stores with memcpy_flushcache() */
+	NVMEV_COPY_AVX2, /* 32-byte non-temporal stores */
+	NVMEV_COPY_AVX512, /* 64-byte non-temporal stores */
+	NR_NVMEV_COPY_ENGINES,
+};
+
+typedef void (*nvmev_copy_fn)(void *dst, const void *src, size_t size);
+
+extern nvmev_copy_fn nvmev_copy_fns[NR_NVMEV_COPY_DIRS];
+
+/*
+ * Pick the copy engine of each direction by name. "auto" takes memcpy for
+ * reads, and for writes benchmarks the engines available on the host against
+ * @bench_size bytes of @storage and takes the fastest one. A @bench_size of 0
+ * sizes the benchmark after the last-level cache.
+ */
+void nvmev_copy_init(const char *read_engine, const char *write_engine, void *storage,
+		     size_t storage_size, size_t bench_size);
+
+static inline void nvmev_copy(int dir, void *dst, const void *src, size_t size)
+{
+	nvmev_copy_fns[dir](dst, src, size);
+}
+
+#endif /* _LIB_NVMEV_COPY_H */
@@ -8,6 +8,7 @@
 #include <linux/init.h>
 #include <linux/sched/task.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 
 #include "dma.h"
 
@@ -94,6 +95,12 @@ static char test_channel[CHANNEL_NAME_LEN];
 
 static struct ioat_dma_thread dma_thread;
 
+/* memcpy channels to spread the asynchronous copies over */
+#define NR_MAX_DMA_CHANNELS 32
+static struct dma_chan *dma_chans[NR_MAX_DMA_CHANNELS];
+static unsigned int nr_dma_chans;
+static atomic_t dma_chan_turn = ATOMIC_INIT(0);
+
 static bool ioat_dma_match_channel(struct ioat_dma_params *params, struct dma_chan *chan)
 {
 	if (params->channel[0] == '\0')
@@ -115,68 +122,104 @@ static void result(const char *err, unsigned int n, dma_addr_t src_addr, dma_add
 		 current->comm, n, err, src_addr, dst_addr, len, data);
 }
 
+/*
+ * Copy synchronously on the channel of dma_thread. Returns -EBUSY if the
+ * channel is out of descriptors for now. The channel may be shared with the
+ * asynchronous copies of the other io workers, so it is never terminated here.
+ */
 int ioat_dma_submit(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size)
 {
 	struct ioat_dma_thread *thread = &dma_thread;
-	struct ioat_dma_info *info;
 	struct dma_chan *chan;
 	struct dma_device *dev;
 	dma_cookie_t cookie;
 	enum dma_status status;
 	enum dma_ctrl_flags flags = DMA_CTRL_ACK; /* Always use polled mode */
-	int ret;
-	int i;
 	struct dma_async_tx_descriptor *tx = NULL;
 
-	set_freezable();
-
 	pr_debug("START: 0x%llx -> 0x%llx, len: %d\n", src_addr, dst_addr, size);
 
-	ret = -ENOMEM;
-
 	smp_rmb();
-	info = thread->info;
 	chan = thread->chan;
 	dev = chan->device;
 
 	/* thread->type is always DMA_MEMCPY */
 	tx = dev->device_prep_dma_memcpy(chan, dst_addr, src_addr, size, flags);
-
-	if (!tx) {
-		result("prep error", 1, src_addr, dst_addr, size, ret);
-		msleep(100);
-		goto out;
-	}
+	if (!tx)
+		return -EBUSY;
 
 	cookie = tx->tx_submit(tx);
-
 	if (dma_submit_error(cookie)) {
-		result("submit error", 1, src_addr, dst_addr, size, ret);
-		msleep(100);
-		goto out;
+		result("submit error", 1, src_addr, dst_addr, size, cookie);
+		return -EIO;
 	}
 
 	/* Always use polled mode */
 	status = dma_sync_wait(chan, cookie);
-	dmaengine_terminate_sync(chan);
 
 	if (status != DMA_COMPLETE &&
 	    !(dma_has_cap(DMA_COMPLETION_NO_ORDER, dev->cap_mask) && status == DMA_OUT_OF_ORDER)) {
 		result(status == DMA_ERROR ? "completion error status" : "completion busy status",
-		       1, src_addr, dst_addr, size, ret);
-		goto out;
+		       1, src_addr, dst_addr, size, status);
+		return -EIO;
 	}
 
-	ret = 0;
-
-out:
 	pr_debug("DONE: 0x%llx -> 0x%llx, len: %d\n", src_addr, dst_addr, size);
 
-	/* terminate all transfers on specified channels */
-	if (ret)
-		dmaengine_terminate_sync(chan);
+	return 0;
+}
 
-	return ret;
+/*
+ * Queue a copy on the next channel in turn, to be started by
+ * ioat_dma_issue_pending(). @callback is called on the completion, from the
+ * interrupt handling of the channel. Returns -EBUSY if the channel is out of
+ * descriptors for now.
+ */
+int ioat_dma_submit_async(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size,
+			  dma_async_tx_callback_result callback, void *param)
+{
+	struct dma_chan *chan;
+	struct dma_async_tx_descriptor *tx;
+	dma_cookie_t cookie;
+
+	if (!nr_dma_chans)
+		return -ENODEV;
+
+	chan = dma_chans[(unsigned int)atomic_inc_return(&dma_chan_turn) % nr_dma_chans];
+
+	tx = chan->device->device_prep_dma_memcpy(chan, dst_addr, src_addr, size,
+						  DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!tx)
+		return -EBUSY;
+
+	tx->callback_result = callback;
+	tx->callback_param = param;
+
+	cookie = tx->tx_submit(tx);
+	if (dma_submit_error(cookie)) {
+		result("submit error", 1, src_addr, dst_addr, size, cookie);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Start the copies queued on all channels */
+void ioat_dma_issue_pending(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_dma_chans; i++)
+		dma_async_issue_pending(dma_chans[i]);
+}
+
+/* Drop the queued copies and wait for the running callbacks */
+void ioat_dma_terminate(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_dma_chans; i++)
+		dmaengine_terminate_sync(dma_chans[i]);
 }
 
 static int ioat_dma_add_channel(struct ioat_dma_info *info, struct dma_chan *chan)
@@ -204,6 +247,9 @@ static int ioat_dma_add_channel(struct ioat_dma_info *info, struct dma_chan *cha
 		dma_thread.info = info;
 		dma_thread.chan = dtc->chan;
 		dma_thread.type = DMA_MEMCPY;
+
+		if (nr_dma_chans < NR_MAX_DMA_CHANNELS)
+			dma_chans[nr_dma_chans++] = dtc->chan;
 	}
 
 	pr_info("Added %u threads using %s\n", thread_count, dma_chan_name(chan));
@@ -315,6 +361,38 @@ add_chan_err:
 	return ret;
 }
 
+/*
+ * Add the comma-separated channels in @list, e.g., "dma7chan0,dma7chan1".
+ * An empty list takes all the memcpy channels available.
+ */
+int ioat_dma_chans_set(const char *list)
+{
+	char *buf, *names, *name;
+	int ret = 0;
+
+	if (!*list)
+		return ioat_dma_chan_set("");
+
+	buf = names = kstrdup(list, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while ((name = strsep(&names, ",")) != NULL) {
+		if (strlen(name) >= CHANNEL_NAME_LEN) {
+			pr_err("Invalid DMA channel %s\n", name);
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = ioat_dma_chan_set(name);
+		if (ret)
+			break;
+	}
+
+	kfree(buf);
+	return ret;
+}
+
 static void ioat_dma_cleanup_channel(struct ioat_dma_chan *dtc)
 {
 	/* terminate all transfers on specified channels */
@@ -339,4 +417,5 @@ void ioat_dma_cleanup(void)
 	}
 
 	info->nr_channels = 0;
+	nr_dma_chans = 0;
 }
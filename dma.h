@@ -3,9 +3,16 @@
 #ifndef _LIB_DMA_H
 #define _LIB_DMA_H
 
+#include <linux/dmaengine.h>
+
 // DMA Init, Final Function
 int ioat_dma_chan_set(const char *val);
+int ioat_dma_chans_set(const char *list);
 int ioat_dma_submit(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size);
+int ioat_dma_submit_async(dma_addr_t src_addr, dma_addr_t dst_addr, unsigned int size,
+			  dma_async_tx_callback_result callback, void *param);
+void ioat_dma_issue_pending(void);
+void ioat_dma_terminate(void);
 void ioat_dma_cleanup(void);
 
 #endif /* _LIB_DMA_H */
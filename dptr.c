@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <linux/kernel.h>
+#include <linux/highmem.h>
+
+#include "nvmev.h"
+#include "dptr.h"
+#include "copy.h"
+
+#define PRP_LIST_ENTRIES (PAGE_SIZE / sizeof(u64))
+
+static void __read_host(void *dst, u64 paddr, size_t size)
+{
+#ifdef CONFIG_64BIT
+	memcpy(dst, phys_to_virt(paddr), size);
+#else
+	void *vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
+
+	memcpy(dst, vaddr + (paddr & PAGE_OFFSET_MASK), size);
+	kunmap_atomic(vaddr);
+#endif
+}
+
+void nvmev_dptr_init(struct nvmev_dptr_iter *iter, u8 flags, u64 dptr1, u64 dptr2, size_t length)
+{
+	iter->is_sgl = flags & NVME_CMD_SGL_ALL;
+	iter->remaining = length;
+	iter->status = NVME_SC_SUCCESS;
+	iter->next_size = 0;
+
+	if (iter->is_sgl) {
+		/* DPTR holds the first SGL descriptor */
+		iter->desc.addr = dptr1;
+		iter->desc.length = lower_32_bits(dptr2);
+		iter->desc.type = dptr2 >> 56;
+		iter->has_desc = true;
+		iter->seg_nr_descs = 0;
+		iter->is_last_seg = false;
+	} else {
+		iter->prp1 = dptr1;
+		iter->prp2 = dptr2;
+		iter->nr_prps = 0;
+		iter->prp_list = NULL;
+		iter->list_offs = 0;
+	}
+}
+
+/* Map the page of the PRP list entry at @paddr */
+static void __map_prp_list(struct nvmev_dptr_iter *iter, u64 paddr)
+{
+#ifdef CONFIG_64BIT
+	/* No atomic mapping, as the DMA path may sleep while walking */
+	iter->prp_list = phys_to_virt(paddr - (paddr & PAGE_OFFSET_MASK));
+#else
+	if (iter->prp_list != NULL)
+		kunmap_atomic(iter->prp_list);
+	iter->prp_list = kmap_atomic_pfn(PRP_PFN(paddr));
+#endif
+	iter->list_offs = (paddr & PAGE_OFFSET_MASK) / sizeof(u64);
+}
+
+unsigned int nvmev_dptr_final(struct nvmev_dptr_iter *iter)
+{
+#ifndef CONFIG_64BIT
+	if (iter->prp_list != NULL)
+		kunmap_atomic(iter->prp_list);
+#endif
+
+	return iter->status;
+}
+
+static u64 __prp_list_next(struct nvmev_dptr_iter *iter)
+{
+	/*
+	 * The last entry of a PRP list page points to the next page of the
+	 * list, unless it is the last PRP of the transfer.
+	 */
+	if (iter->list_offs == PRP_LIST_ENTRIES - 1 && iter->remaining > PAGE_SIZE)
+		__map_prp_list(iter, iter->prp_list[iter->list_offs]);
+
+	return iter->prp_list[iter->list_offs++];
+}
+
+static bool __prp_next_piece(struct nvmev_dptr_iter *iter, u64 *paddr, size_t *size)
+{
+	iter->nr_prps++;
+	if (iter->nr_prps == 1) {
+		*paddr = iter->prp1;
+	} else if (iter->nr_prps == 2) {
+		*paddr = iter->prp2;
+		if (iter->remaining > PAGE_SIZE) {
+			__map_prp_list(iter, *paddr);
+			*paddr = __prp_list_next(iter);
+		}
+	} else {
+		*paddr = __prp_list_next(iter);
+	}
+
+	/* Only the first PRP may have an offset in the page */
+	*size = min_t(size_t, iter->remaining, PAGE_SIZE - (*paddr & PAGE_OFFSET_MASK));
+
+	return true;
+}
+
+/* Fetch the next data or bit bucket descriptor, following the segments */
+static bool __sgl_next_desc(struct nvmev_dptr_iter *iter, struct nvme_sgl_desc *desc)
+{
+	while (true) {
+		if (iter->has_desc) {
+			*desc = iter->desc;
+			iter->has_desc = false;
+		} else if (iter->seg_nr_descs) {
+			__read_host(desc, iter->seg_addr, sizeof(*desc));
+			iter->seg_addr += sizeof(*desc);
+			iter->seg_nr_descs--;
+		} else {
+			/* The SGL describes less data than the command transfers */
+			iter->status = NVME_SC_SGL_INVALID_DATA;
+			return false;
+		}
+
+		switch (desc->type >> 4) {
+		case NVME_SGL_FMT_DATA_DESC:
+		case NVME_SGL_FMT_BIT_BUCKET_DESC:
+			if ((desc->type & 0xf) != NVME_SGL_FMT_ADDRESS) {
+				iter->status = NVME_SC_SGL_INVALID_TYPE;
+				return false;
+			}
+			if (desc->length)
+				return true;
+			break;
+		case NVME_SGL_FMT_SEG_DESC:
+		case NVME_SGL_FMT_LAST_SEG_DESC:
+			/* Only the last descriptor of a segment, but the last segment, may chain */
+			if (iter->seg_nr_descs || iter->is_last_seg) {
+				iter->status = NVME_SC_SGL_INVALID_LAST;
+				return false;
+			}
+			if (!desc->length || desc->length % sizeof(*desc)) {
+				iter->status = NVME_SC_SGL_INVALID_COUNT;
+				return false;
+			}
+			iter->seg_addr = desc->addr;
+			iter->seg_nr_descs = desc->length / sizeof(*desc);
+			iter->is_last_seg = (desc->type >> 4) == NVME_SGL_FMT_LAST_SEG_DESC;
+			break;
+		default:
+			iter->status = NVME_SC_SGL_INVALID_TYPE;
+			return false;
+		}
+	}
+}
+
+static bool __sgl_next_piece(struct nvmev_dptr_iter *iter, u64 *paddr, size_t *size)
+{
+	struct nvme_sgl_desc desc;
+
+	if (!__sgl_next_desc(iter, &desc))
+		return false;
+
+	if ((desc.type >> 4) == NVME_SGL_FMT_BIT_BUCKET_DESC)
+		*paddr = NVMEV_DPTR_BIT_BUCKET;
+	else
+		*paddr = desc.addr;
+
+	/* Data described beyond the transfer is not touched */
+	*size = min_t(size_t, iter->remaining, desc.length);
+
+	return true;
+}
+
+static bool __dptr_next_piece(struct nvmev_dptr_iter *iter, u64 *paddr, size_t *size)
+{
+	bool ret;
+
+	if (!iter->remaining || iter->status != NVME_SC_SUCCESS)
+		return false;
+
+	if (iter->is_sgl)
+		ret = __sgl_next_piece(iter, paddr, size);
+	else
+		ret = __prp_next_piece(iter, paddr, size);
+
+	if (ret)
+		iter->remaining -= *size;
+
+	return ret;
+}
+
+size_t nvmev_dptr_next(struct nvmev_dptr_iter *iter, u64 *paddr)
+{
+	u64 next_paddr;
+	size_t size, next_size;
+
+	if (iter->next_size) {
+		*paddr = iter->next_paddr;
+		size = iter->next_size;
+		iter->next_size = 0;
+	} else if (!__dptr_next_piece(iter, paddr, &size)) {
+		return 0;
+	}
+
+	/* Merge the pieces that are physically contiguous with each other */
+	while (__dptr_next_piece(iter, &next_paddr, &next_size)) {
+		if (*paddr == NVMEV_DPTR_BIT_BUCKET || next_paddr != *paddr + size) {
+			iter->next_paddr = next_paddr;
+			iter->next_size = next_size;
+			break;
+		}
+		size += next_size;
+	}
+
+	return size;
+}
+
+static void __copy_extent(void *mem, u64 paddr, size_t size, int dir)
+{
+#ifdef CONFIG_64BIT
+	/* Host memory is all in the direct map; copy the extent at once */
+	void *vaddr = phys_to_virt(paddr);
+
+	if (dir == NVMEV_COPY_READ)
+		nvmev_copy(NVMEV_COPY_READ, vaddr, mem, size);
+	else
+		nvmev_copy(NVMEV_COPY_WRITE, mem, vaddr, size);
+#else
+	while (size) {
+		size_t mem_offs = paddr & PAGE_OFFSET_MASK;
+		size_t io_size = min_t(size_t, size, PAGE_SIZE - mem_offs);
+		void *vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
+
+		if (dir == NVMEV_COPY_READ)
+			nvmev_copy(NVMEV_COPY_READ, vaddr + mem_offs, mem, io_size);
+		else
+			nvmev_copy(NVMEV_COPY_WRITE, mem, vaddr + mem_offs, io_size);
+
+		kunmap_atomic(vaddr);
+
+		paddr += io_size;
+		mem += io_size;
+		size -= io_size;
+	}
+#endif
+}
+
+unsigned int nvmev_dptr_copy(u8 flags, u64 dptr1, u64 dptr2, void *mem, size_t length, int dir)
+{
+	struct nvmev_dptr_iter iter;
+	size_t io_size;
+	u64 paddr;
+
+	nvmev_dptr_init(&iter, flags, dptr1, dptr2, length);
+
+	while ((io_size = nvmev_dptr_next(&iter, &paddr))) {
+		if (paddr != NVMEV_DPTR_BIT_BUCKET) {
+			__copy_extent(mem, paddr, io_size, dir);
+		} else if (dir == NVMEV_COPY_WRITE) {
+			/* Bit buckets only discard read data */
+			iter.status = NVME_SC_SGL_INVALID_TYPE;
+			break;
+		}
+		mem += io_size;
+	}
+
+	return nvmev_dptr_final(&iter);
+}
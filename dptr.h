@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#ifndef _LIB_NVMEV_DPTR_H
+#define _LIB_NVMEV_DPTR_H
+
+#include "nvme.h"
+
+/* Host address of the extents described by a bit bucket descriptor */
+#define NVMEV_DPTR_BIT_BUCKET (~0ULL)
+
+/*
+ * Walks the data pointer of a command, either PRPs or an SGL, in extents of
+ * physically contiguous host memory.
+ */
+struct nvmev_dptr_iter {
+	bool is_sgl;
+	size_t remaining; /* bytes not fetched yet */
+	unsigned int status; /* NVME_SC_* once the data pointer turns out malformed */
+
+	/* PRPs */
+	u64 prp1;
+	u64 prp2;
+	unsigned int nr_prps; /* fetched so far */
+	u64 *prp_list; /* mapped page of the PRP list, if PRP2 points to one */
+	unsigned int list_offs; /* next entry in @prp_list */
+
+	/* SGL */
+	struct nvme_sgl_desc desc; /* in the command, until it is fetched */
+	bool has_desc;
+	u64 seg_addr; /* next descriptor in the current segment */
+	unsigned int seg_nr_descs; /* left in the current segment */
+	bool is_last_seg;
+
+	/* A piece fetched ahead, which did not extend the last extent */
+	u64 next_paddr;
+	size_t next_size;
+};
+
+void nvmev_dptr_init(struct nvmev_dptr_iter *iter, u8 flags, u64 dptr1, u64 dptr2, size_t length);
+
+/*
+ * Returns the size of the next extent starting at @paddr, or 0 at the end.
+ * @paddr is NVMEV_DPTR_BIT_BUCKET for data the host does not want.
+ */
+size_t nvmev_dptr_next(struct nvmev_dptr_iter *iter, u64 *paddr);
+
+/* Returns NVME_SC_SUCCESS, or the error found in the data pointer */
+unsigned int nvmev_dptr_final(struct nvmev_dptr_iter *iter);
+
+/*
+ * Copy @length bytes between @mem and the host memory of the data pointer,
+ * in the direction @dir (NVMEV_COPY_READ or NVMEV_COPY_WRITE).
+ */
+unsigned int nvmev_dptr_copy(u8 flags, u64 dptr1, u64 dptr2, void *mem, size_t length, int dir);
+
+#endif /* _LIB_NVMEV_DPTR_H */
@@ -1,12 +1,18 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include <linux/kthread.h>
+#include <linux/delay.h>
 #include <linux/ktime.h>
 #include <linux/highmem.h>
 #include <linux/sched/clock.h>
+#include <linux/sched/task.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
 
 #include "nvmev.h"
 #include "dma.h"
+#include "copy.h"
+#include "dptr.h"
 
 #if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
 #include "ssd.h"
@@ -14,27 +20,41 @@
 struct buffer;
 #endif
 
-#undef PERF_DEBUG
-
 #define sq_entry(entry_id) sq->sq[SQ_ENTRY_TO_PAGE_NUM(entry_id)][SQ_ENTRY_TO_PAGE_OFFSET(entry_id)]
 #define cq_entry(entry_id) cq->cq[CQ_ENTRY_TO_PAGE_NUM(entry_id)][CQ_ENTRY_TO_PAGE_OFFSET(entry_id)]
 
 extern bool io_using_dma;
+extern bool io_dma_async;
+
+/* Requests with DMA copies in flight, drained by NVMEV_IO_WORKER_FINAL() */
+static atomic_t nr_dma_reqs = ATOMIC_INIT(0);
+static bool dma_stopping;
+
+/*
+ * io workers are sharded over the dispatchers; worker i belongs to dispatcher
+ * (i % nr_dispatchers) so that each worker is fed by a single dispatcher.
+ */
+static inline unsigned int __nr_shard_io_workers(unsigned int dispatcher_id)
+{
+	unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+
+	return (nvmev_vdev->config.nr_io_workers - dispatcher_id + nr_dispatchers - 1) /
+	       nr_dispatchers;
+}
 
 static inline unsigned int __get_io_worker(int sqid)
 {
+	unsigned int nr_dispatchers = nvmev_vdev->config.nr_dispatchers;
+	unsigned int dispatcher_id = nvmev_get_dispatcher(sqid);
+
 #ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
-	return (sqid - 1) % nvmev_vdev->config.nr_io_workers;
+	return dispatcher_id +
+	       ((sqid - 1) / nr_dispatchers % __nr_shard_io_workers(dispatcher_id)) * nr_dispatchers;
 #else
-	return nvmev_vdev->io_worker_turn;
+	return dispatcher_id + nvmev_vdev->dispatchers[dispatcher_id].io_worker_turn * nr_dispatchers;
 #endif
 }
 
-static inline unsigned long long __get_wallclock(void)
-{
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
-}
-
 static inline size_t __cmd_io_offset(struct nvme_rw_command *cmd)
 {
 	return (cmd->slba) << LBA_BITS;
@@ -45,364 +65,317 @@ static inline size_t __cmd_io_size(struct nvme_rw_command *cmd)
 	return (cmd->length + 1) << LBA_BITS;
 }
 
+/* Returns NVME_SC_SUCCESS, or the error found in the data pointer */
 static unsigned int __do_perform_io(int sqid, int sq_entry)
 {
 	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
 	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
-	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
 	size_t nsid = cmd->nsid - 1; // 0-based
+	void *mem = nvmev_vdev->ns[nsid].mapped + __cmd_io_offset(cmd);
+	size_t length = __cmd_io_size(cmd);
 
-	offset = __cmd_io_offset(cmd);
-	length = __cmd_io_size(cmd);
-	remaining = length;
+	if (cmd->opcode == nvme_cmd_write || cmd->opcode == nvme_cmd_zone_append)
+		return nvmev_dptr_copy(cmd->flags, cmd->prp1, cmd->prp2, mem, length,
+				       NVMEV_COPY_WRITE);
+	else if (cmd->opcode == nvme_cmd_read)
+		return nvmev_dptr_copy(cmd->flags, cmd->prp1, cmd->prp2, mem, length,
+				       NVMEV_COPY_READ);
 
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-		size_t mem_offs = 0;
-
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = cmd->prp1;
-		} else if (prp_offs == 2) {
-			paddr = cmd->prp2;
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
+	return NVME_SC_SUCCESS;
+}
 
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
+static inline struct nvmev_io_work *__io_work(struct nvmev_io_worker *worker, unsigned int entry)
+{
+	return &worker->work_chunks[entry >> IO_WORK_CHUNK_SHIFT][entry & (IO_WORK_CHUNK_SIZE - 1)];
+}
 
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
+/*
+ * With skip_idle, a request counts in nvmev_clock.nr_unsettled from its
+ * enqueue until it is both copied and in the io_tree of its io worker. The
+ * clock is thus never skipped over a request sitting in a ring, being copied
+ * by a copier or another io worker, or waiting for the DMA engine.
+ */
+static inline void __settle_req(struct nvmev_io_work *w)
+{
+	/* Fully ordered; the due time is published before, see __skip_idle_time() */
+	if (nvmev_clock.skip_idle && atomic_dec_and_test(&w->settle_refs))
+		atomic_dec(&nvmev_clock.nr_unsettled);
+}
 
-		if (cmd->opcode == nvme_cmd_write ||
-		    cmd->opcode == nvme_cmd_zone_append) {
-			memcpy(nvmev_vdev->ns[nsid].mapped + offset, vaddr + mem_offs, io_size);
-		} else if (cmd->opcode == nvme_cmd_read) {
-			memcpy(vaddr + mem_offs, nvmev_vdev->ns[nsid].mapped + offset, io_size);
-		}
+static void __insert_req_sorted(unsigned int entry, struct nvmev_io_worker *worker,
+				unsigned long nsecs_target)
+{
+	/**
+	 * Requests whose data is in place wait in @io_tree for their target
+	 * time. Work entries are pooled to minimize the influence of dynamic
+	 * memory allocation, and the tree just links them.
+	 * The tree keeps track of the leftmost entry so that the next request
+	 * to complete is found in O(1) and inserted/removed in O(logn).
+	 */
+	struct nvmev_io_work *w = __io_work(worker, entry);
+	struct rb_node **link = &worker->io_tree.rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true;
 
-		kunmap_atomic(vaddr);
+	while (*link) {
+		struct nvmev_io_work *curr = rb_entry(*link, struct nvmev_io_work, node);
 
-		remaining -= io_size;
-		offset += io_size;
+		parent = *link;
+		if (nsecs_target < curr->nsecs_target) {
+			link = &parent->rb_left;
+		} else {
+			/* Keep the arrival order among the requests of the same target */
+			link = &parent->rb_right;
+			leftmost = false;
+		}
 	}
+	rb_link_node(&w->node, parent, link);
+	rb_insert_color_cached(&w->node, &worker->io_tree, leftmost);
 
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
+	/* Other io workers may look at the next due time before this one gets to */
+	if (nvmev_clock.skip_idle && nsecs_target < READ_ONCE(worker->nsecs_next_due))
+		WRITE_ONCE(worker->nsecs_next_due, nsecs_target);
+	__settle_req(w);
+}
 
-	return length;
+static void __enqueue_copy(unsigned int entry, struct nvmev_io_worker *worker)
+{
+	/* Requests are copied in the order they arrive */
+	__io_work(worker, entry)->next = -1;
+
+	spin_lock(&worker->copy_lock);
+	if (worker->copy_seq == -1)
+		WRITE_ONCE(worker->copy_seq, entry);
+	else
+		__io_work(worker, worker->copy_seq_end)->next = entry;
+	worker->copy_seq_end = entry;
+	spin_unlock(&worker->copy_lock);
 }
 
-static u64 paddr_list[513] = {
-	0,
-}; // Not using index 0 to make max index == num_prp
-static unsigned int __do_perform_io_using_dma(int sqid, int sq_entry)
+static unsigned int __dequeue_copy_locked(struct nvmev_io_worker *worker)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvme_rw_command *cmd = &sq_entry(sq_entry).rw;
-	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	int num_prps = 0;
-	u64 paddr;
-	u64 *tmp_paddr_list = NULL;
-	size_t io_size;
-	size_t mem_offs = 0;
-
-	offset = __cmd_io_offset(cmd);
-	length = __cmd_io_size(cmd);
-	remaining = length;
-
-	memset(paddr_list, 0, sizeof(paddr_list));
-	/* Loop to get the PRP list */
-	while (remaining) {
-		io_size = 0;
-
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr_list[prp_offs] = cmd->prp1;
-		} else if (prp_offs == 2) {
-			paddr_list[prp_offs] = cmd->prp2;
-			if (remaining > PAGE_SIZE) {
-				tmp_paddr_list = kmap_atomic_pfn(PRP_PFN(paddr_list[prp_offs])) +
-						 (paddr_list[prp_offs] & PAGE_OFFSET_MASK);
-				paddr_list[prp_offs] = tmp_paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr_list[prp_offs] = tmp_paddr_list[prp2_offs++];
-		}
+	unsigned int entry = worker->copy_seq;
 
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
+	if (entry != -1)
+		WRITE_ONCE(worker->copy_seq, __io_work(worker, entry)->next);
 
-		if (paddr_list[prp_offs] & PAGE_OFFSET_MASK) {
-			mem_offs = paddr_list[prp_offs] & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
+	return entry;
+}
 
-		remaining -= io_size;
-	}
-	num_prps = prp_offs;
+static unsigned int __dequeue_copy(struct nvmev_io_worker *worker)
+{
+	unsigned int entry;
 
-	if (tmp_paddr_list != NULL)
-		kunmap_atomic(tmp_paddr_list);
+	if (READ_ONCE(worker->copy_seq) == -1)
+		return -1;
 
-	remaining = length;
-	prp_offs = 1;
+	spin_lock(&worker->copy_lock);
+	entry = __dequeue_copy_locked(worker);
+	spin_unlock(&worker->copy_lock);
 
-	/* Loop for data transfer */
-	while (remaining) {
-		size_t page_size;
-		mem_offs = 0;
-		io_size = 0;
-		page_size = 0;
+	return entry;
+}
 
-		paddr = paddr_list[prp_offs];
-		page_size = min_t(size_t, remaining, PAGE_SIZE);
+static inline void __ring_put(struct nvmev_io_ring *ring, unsigned int nr, unsigned int entry)
+{
+	ring->entries[(ring->head + nr) & (ring->size - 1)] = entry;
+}
 
-		/* For non-page aligned paddr, it will never be between continuous PRP list (Always first paddr)  */
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (page_size + mem_offs > PAGE_SIZE) {
-				page_size = PAGE_SIZE - mem_offs;
-			}
-		}
+static inline void __ring_publish(struct nvmev_io_ring *ring, unsigned int nr)
+{
+	smp_store_release(&ring->head, ring->head + nr); /* Consumer shall see the entries at once */
+}
 
-		for (prp_offs++; prp_offs <= num_prps; prp_offs++) {
-			if (paddr_list[prp_offs] == paddr_list[prp_offs - 1] + PAGE_SIZE)
-				page_size += PAGE_SIZE;
-			else
-				break;
-		}
+static inline void __ring_push(struct nvmev_io_ring *ring, unsigned int entry)
+{
+	__ring_put(ring, 0, entry);
+	__ring_publish(ring, 1);
+}
 
-		io_size = min_t(size_t, remaining, page_size);
+static inline bool __ring_empty(struct nvmev_io_ring *ring)
+{
+	return ring->tail == smp_load_acquire(&ring->head);
+}
 
-		if (cmd->opcode == nvme_cmd_write ||
-		    cmd->opcode == nvme_cmd_zone_append) {
-			ioat_dma_submit(paddr, nvmev_vdev->config.storage_start + offset, io_size);
-		} else if (cmd->opcode == nvme_cmd_read) {
-			ioat_dma_submit(nvmev_vdev->config.storage_start + offset, paddr, io_size);
-		}
+static inline bool __ring_pop(struct nvmev_io_ring *ring, unsigned int *entry)
+{
+	unsigned int tail = ring->tail;
 
-		remaining -= io_size;
-		offset += io_size;
+	if (tail == ring->head_cache) {
+		ring->head_cache = smp_load_acquire(&ring->head);
+		if (tail == ring->head_cache)
+			return false;
 	}
 
-	return length;
+	*entry = ring->entries[tail & (ring->size - 1)];
+	WRITE_ONCE(ring->tail, tail + 1);
+
+	return true;
 }
 
-static void __insert_req_sorted(unsigned int entry, struct nvmev_io_worker *worker,
-				unsigned long nsecs_target)
+static bool __grow_work_pool(struct nvmev_io_worker *worker)
 {
-	/**
-	 * Requests are placed in @work_queue sorted by their target time.
-	 * @work_queue is statically allocated and the ordered list is
-	 * implemented by chaining the indexes of entries with @prev and @next.
-	 * This implementation is nasty but we do this way over dynamically
-	 * allocated linked list to minimize the influence of dynamic memory allocation.
-	 * Also, this O(n) implementation can be improved to O(logn) scheme with
-	 * e.g., red-black tree but....
-	 */
-	if (worker->io_seq == -1) {
-		worker->io_seq = entry;
-		worker->io_seq_end = entry;
-	} else {
-		unsigned int curr = worker->io_seq_end;
+	struct nvmev_io_work *chunk;
+	unsigned int i;
 
-		while (curr != -1) {
-			if (worker->work_queue[curr].nsecs_target <= worker->latest_nsecs)
-				break;
+	if (worker->nr_works == NR_MAX_PARALLEL_IO)
+		return false;
 
-			if (worker->work_queue[curr].nsecs_target <= nsecs_target)
-				break;
+	chunk = kzalloc(sizeof(struct nvmev_io_work) * IO_WORK_CHUNK_SIZE, GFP_KERNEL);
+	if (!chunk)
+		return false;
 
-			curr = worker->work_queue[curr].prev;
-		}
+	for (i = 0; i < IO_WORK_CHUNK_SIZE; i++)
+		chunk[i].id = worker->nr_works + i;
 
-		if (curr == -1) { /* Head inserted */
-			worker->work_queue[worker->io_seq].prev = entry;
-			worker->work_queue[entry].next = worker->io_seq;
-			worker->io_seq = entry;
-		} else if (worker->work_queue[curr].next == -1) { /* Tail */
-			worker->work_queue[entry].prev = curr;
-			worker->io_seq_end = entry;
-			worker->work_queue[curr].next = entry;
-		} else { /* In between */
-			worker->work_queue[entry].prev = curr;
-			worker->work_queue[entry].next = worker->work_queue[curr].next;
-
-			worker->work_queue[worker->work_queue[entry].next].prev = entry;
-			worker->work_queue[curr].next = entry;
-		}
-	}
+	/* Published to the io worker along with the entries through @submission */
+	worker->work_chunks[worker->nr_works >> IO_WORK_CHUNK_SHIFT] = chunk;
+	worker->nr_works += IO_WORK_CHUNK_SIZE;
+
+	return true;
 }
 
+/*
+ * Reserve a free entry at the io worker of @sqid, before the request is
+ * charged to the FTL. Returns NULL if the io worker has no room for it.
+ */
 static struct nvmev_io_worker *__allocate_work_queue_entry(int sqid, unsigned int *entry)
 {
-	unsigned int io_worker_turn = __get_io_worker(sqid);
-	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[io_worker_turn];
-	unsigned int e = worker->free_seq;
-	struct nvmev_io_work *w = worker->work_queue + e;
+	struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[__get_io_worker(sqid)];
 
-	if (w->next >= NR_MAX_PARALLEL_IO) {
-		WARN_ON_ONCE("IO queue is almost full");
-		return NULL;
+	/* Left over by a request that did not make it past the FTL */
+	if (worker->spare_entry != -1) {
+		*entry = worker->spare_entry;
+		worker->spare_entry = -1;
+		return worker;
 	}
 
-	if (++io_worker_turn == nvmev_vdev->config.nr_io_workers)
-		io_worker_turn = 0;
-	nvmev_vdev->io_worker_turn = io_worker_turn;
-
-	worker->free_seq = w->next;
-	BUG_ON(worker->free_seq >= NR_MAX_PARALLEL_IO);
-	*entry = e;
+	/*
+	 * Free entries are handed back by the io worker through @reclaim. Use
+	 * the entries never used before only when none is, growing the pool
+	 * up to NR_MAX_PARALLEL_IO entries.
+	 */
+	if (!__ring_pop(&worker->reclaim, entry)) {
+		if (worker->next_fresh == worker->nr_works && !__grow_work_pool(worker))
+			return NULL;
+		*entry = worker->next_fresh++;
+	}
 
 	return worker;
 }
 
-static void __enqueue_io_req(int sqid, int cqid, int sq_entry, unsigned long long nsecs_start,
-			     struct nvmev_result *ret)
+/* Give back an entry reserved for a request that is left in the SQ */
+static inline void __release_work_queue_entry(struct nvmev_io_worker *worker, unsigned int entry)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	struct nvmev_io_worker *worker;
-	struct nvmev_io_work *w;
-	unsigned int entry;
+	worker->spare_entry = entry;
+}
 
-	worker = __allocate_work_queue_entry(sqid, &entry);
-	if (!worker)
+static inline void __wake_io_worker(struct nvmev_io_worker *worker)
+{
+	if (!nvmev_vdev->config.idle_poll_us)
 		return;
 
-	w = worker->work_queue + entry;
+	smp_mb(); /* Pairs with smp_store_mb() in __io_worker_sleep() */
+	if (READ_ONCE(worker->is_idle))
+		wake_up_process(worker->task_struct);
+}
+
+static void __enqueue_io_req(struct nvmev_io_worker *worker, unsigned int entry,
+			     struct nvmev_submission_queue *sq, int sq_entry,
+			     unsigned long long nsecs_start, struct nvmev_result *ret)
+{
+	unsigned int dispatcher_id = nvmev_get_dispatcher(sq->qid);
+	struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[dispatcher_id];
+	struct nvmev_io_work *w = __io_work(worker, entry);
+
+	if (++dispatcher->io_worker_turn == __nr_shard_io_workers(dispatcher_id))
+		dispatcher->io_worker_turn = 0;
 
 	NVMEV_DEBUG_VERBOSE("%s/%u[%d], sq %d cq %d, entry %d, %llu + %llu\n", worker->thread_name, entry,
-		    sq_entry(sq_entry).rw.opcode, sqid, cqid, sq_entry, nsecs_start,
+		    sq_entry(sq_entry).rw.opcode, sq->qid, sq->cqid, sq_entry, nsecs_start,
 		    ret->nsecs_target - nsecs_start);
 
 	/////////////////////////////////
-	w->sqid = sqid;
-	w->cqid = cqid;
+	w->sqid = sq->qid;
+	w->cqid = sq->cqid;
 	w->sq_entry = sq_entry;
 	w->command_id = sq_entry(sq_entry).common.command_id;
+	w->opcode = sq_entry(sq_entry).common.opcode;
 	w->nsecs_start = nsecs_start;
-	w->nsecs_enqueue = local_clock();
+	w->nsecs_enqueue = nvmev_get_clock();
 	w->nsecs_target = ret->nsecs_target;
 	w->status = ret->status;
-	w->is_completed = false;
 	w->is_copied = false;
-	w->prev = -1;
-	w->next = -1;
 
-	w->is_internal = false;
-	mb(); /* IO worker shall see the updated w at once */
+	if (nvmev_clock.skip_idle) {
+		atomic_set(&w->settle_refs, 2);
+		atomic_inc(&nvmev_clock.nr_unsettled);
+	}
 
-	__insert_req_sorted(entry, worker, ret->nsecs_target);
+	__ring_push(&worker->submission, entry);
+	__wake_io_worker(worker);
 }
 
-void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
-				 struct buffer *write_buffer, size_t buffs_to_release)
+static inline bool __qos_limited(struct nvmev_qos *qos)
 {
-	struct nvmev_io_worker *worker;
-	struct nvmev_io_work *w;
-	unsigned int entry;
-
-	worker = __allocate_work_queue_entry(sqid, &entry);
-	if (!worker)
-		return;
-
-	w = worker->work_queue + entry;
+	int dir;
 
-	NVMEV_DEBUG_VERBOSE("%s/%u, internal sq %d, %llu + %llu\n", worker->thread_name, entry, sqid,
-		    local_clock(), nsecs_target - local_clock());
-
-	/////////////////////////////////
-	w->sqid = sqid;
-	w->nsecs_start = w->nsecs_enqueue = local_clock();
-	w->nsecs_target = nsecs_target;
-	w->is_completed = false;
-	w->is_copied = true;
-	w->prev = -1;
-	w->next = -1;
-
-	w->is_internal = true;
-	w->write_buffer = write_buffer;
-	w->buffs_to_release = buffs_to_release;
-	mb(); /* IO worker shall see the updated w at once */
-
-	__insert_req_sorted(entry, worker, nsecs_target);
+	for (dir = 0; dir < NR_NVMEV_QOS_DIR; dir++) {
+		if (READ_ONCE(qos->iops[dir].rate) || READ_ONCE(qos->bw[dir].rate))
+			return true;
+	}
+	return false;
 }
 
-static void __reclaim_completed_reqs(void)
+/*
+ * Charge the request to the QoS limits of the SQ and the namespace.
+ * Returns how long the request has to wait for the tokens.
+ */
+static unsigned long long __qos_throttle(struct nvmev_qos *sq_qos, struct nvmev_qos *ns_qos,
+					 struct nvme_command *cmd, size_t io_size,
+					 unsigned long long nsecs)
 {
-	unsigned int turn;
-
-	for (turn = 0; turn < nvmev_vdev->config.nr_io_workers; turn++) {
-		struct nvmev_io_worker *worker;
-		struct nvmev_io_work *w;
-
-		unsigned int first_entry = -1;
-		unsigned int last_entry = -1;
-		unsigned int curr;
-		int nr_reclaimed = 0;
-
-		worker = &nvmev_vdev->io_workers[turn];
-
-		first_entry = worker->io_seq;
-		curr = first_entry;
-
-		while (curr != -1) {
-			w = &worker->work_queue[curr];
-			if (w->is_completed == true && w->is_copied == true &&
-			    w->nsecs_target <= worker->latest_nsecs) {
-				last_entry = curr;
-				curr = w->next;
-				nr_reclaimed++;
-			} else {
-				break;
-			}
-		}
-
-		if (last_entry != -1) {
-			w = &worker->work_queue[last_entry];
-			worker->io_seq = w->next;
-			if (w->next != -1) {
-				worker->work_queue[w->next].prev = -1;
-			}
-			w->next = -1;
-
-			w = &worker->work_queue[first_entry];
-			w->prev = worker->free_seq_end;
+	struct nvmev_qos_limit *limits[4];
+	unsigned long long costs[4] = { 1, io_size, 1, io_size };
+	unsigned long long nsecs_admit = nsecs;
+	int dir, i;
+
+	/* Opcode bits 1:0 tell the data transfer direction */
+	if ((cmd->common.opcode & 0x3) == 0x1)
+		dir = NVMEV_QOS_WRITE;
+	else if ((cmd->common.opcode & 0x3) == 0x2)
+		dir = NVMEV_QOS_READ;
+	else
+		return 0;
+
+	limits[0] = &sq_qos->iops[dir];
+	limits[1] = &sq_qos->bw[dir];
+	limits[2] = &ns_qos->iops[dir];
+	limits[3] = &ns_qos->bw[dir];
+
+	for (i = 0; i < ARRAY_SIZE(limits); i++) {
+		if (!READ_ONCE(limits[i]->rate))
+			continue;
+		if (limits[i]->nsecs_tat > nsecs_admit + NVMEV_QOS_BURST_NS)
+			nsecs_admit = limits[i]->nsecs_tat - NVMEV_QOS_BURST_NS;
+	}
 
-			w = &worker->work_queue[worker->free_seq_end];
-			w->next = first_entry;
+	for (i = 0; i < ARRAY_SIZE(limits); i++) {
+		unsigned long long rate = READ_ONCE(limits[i]->rate);
 
-			worker->free_seq_end = last_entry;
-			NVMEV_DEBUG_VERBOSE("%s: %u -- %u, %d\n", __func__,
-					first_entry, last_entry, nr_reclaimed);
-		}
+		if (!rate)
+			continue;
+		limits[i]->nsecs_tat = max(limits[i]->nsecs_tat, nsecs_admit) +
+				       div64_u64(costs[i] * NS_PER_SEC(1ULL), rate);
 	}
+
+	return nsecs_admit - nsecs;
 }
 
-static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
+static size_t __nvmev_proc_io(struct nvmev_submission_queue *sq, int sq_entry, size_t *io_size)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
-	unsigned long long nsecs_start = __get_wallclock();
+	int sqid = sq->qid;
+	unsigned long long nsecs_start = nvmev_get_clock();
 	struct nvme_command *cmd = &sq_entry(sq_entry);
 #if (BASE_SSD == KV_PROTOTYPE)
 	uint32_t nsid = 0; // Some KVSSD programs give 0 as nsid for KV IO
@@ -410,6 +383,8 @@ static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
 	uint32_t nsid = cmd->common.nsid - 1;
 #endif
 	struct nvmev_ns *ns = &nvmev_vdev->ns[nsid];
+	struct nvmev_io_worker *worker;
+	unsigned int entry;
 
 	struct nvmev_request req = {
 		.cmd = cmd,
@@ -421,56 +396,57 @@ static size_t __nvmev_proc_io(int sqid, int sq_entry, size_t *io_size)
 		.status = NVME_SC_SUCCESS,
 	};
 
-#ifdef PERF_DEBUG
-	unsigned long long prev_clock = local_clock();
-	unsigned long long prev_clock2 = 0;
-	unsigned long long prev_clock3 = 0;
-	unsigned long long prev_clock4 = 0;
-	static unsigned long long clock1 = 0;
-	static unsigned long long clock2 = 0;
-	static unsigned long long clock3 = 0;
-	static unsigned long long counter = 0;
-#endif
-
-	if (!ns->proc_io_cmd(ns, &req, &ret))
+	/*
+	 * Leave the command in the SQ until the io worker has room for it. The
+	 * entry is taken before the FTL is charged for the request, which then
+	 * cannot be dropped.
+	 */
+	worker = __allocate_work_queue_entry(sqid, &entry);
+	if (!worker)
 		return false;
-	*io_size = __cmd_io_size(&sq_entry(sq_entry).rw);
-
-#ifdef PERF_DEBUG
-	prev_clock2 = local_clock();
-#endif
 
-	__enqueue_io_req(sqid, sq->cqid, sq_entry, nsecs_start, &ret);
+	spin_lock(&ns->lock);
+	if (!ns->proc_io_cmd(ns, &req, &ret)) {
+		spin_unlock(&ns->lock);
+		__release_work_queue_entry(worker, entry);
 
-#ifdef PERF_DEBUG
-	prev_clock3 = local_clock();
-#endif
+		/* Park the SQ until the write buffer has room for the command */
+		sq->stall_buffer = ret.wait_buffer;
+		sq->stall_size = ret.wait_size;
+		return false;
+	}
+	spin_unlock(&ns->lock);
+	*io_size = __cmd_io_size(&sq_entry(sq_entry).rw);
 
-	__reclaim_completed_reqs();
+	/* Hold the request back until its SQ and namespace have the tokens for it */
+	if (__qos_limited(&nvmev_vdev->sq_qos[sqid]) || __qos_limited(&ns->qos)) {
+		spin_lock(&ns->qos_lock);
+		spin_lock(&nvmev_vdev->sq_qos_lock[sqid]);
+		ret.nsecs_target += __qos_throttle(&nvmev_vdev->sq_qos[sqid], &ns->qos, cmd,
+						   *io_size, nsecs_start);
+		spin_unlock(&nvmev_vdev->sq_qos_lock[sqid]);
+		spin_unlock(&ns->qos_lock);
+	}
 
-#ifdef PERF_DEBUG
-	prev_clock4 = local_clock();
+	__enqueue_io_req(worker, entry, sq, sq_entry, nsecs_start, &ret);
+	return true;
+}
 
-	clock1 += (prev_clock2 - prev_clock);
-	clock2 += (prev_clock3 - prev_clock2);
-	clock3 += (prev_clock4 - prev_clock3);
-	counter++;
+#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
+/* Have the dispatcher of @sq look at it again once its write buffer is released */
+static void __rearm_stalled_sq(struct nvmev_submission_queue *sq)
+{
+	struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[nvmev_get_dispatcher(sq->qid)];
 
-	if (counter > 1000) {
-		NVMEV_DEBUG("LAT: %llu, ENQ: %llu, CLN: %llu\n", clock1 / counter, clock2 / counter,
-			    clock3 / counter);
-		clock1 = 0;
-		clock2 = 0;
-		clock3 = 0;
-		counter = 0;
-	}
-#endif
-	return true;
+	dispatcher->nsecs_rearm =
+		min_t(u64, dispatcher->nsecs_rearm, READ_ONCE(sq->stall_buffer->nsecs_next_release));
 }
+#endif
 
-int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
+int nvmev_proc_io_sq(int sqid, int new_db, int old_db, int max_proc)
 {
-	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[sqid];
+	/* Read once; Delete SQ clears it and waits for this pass to end */
+	struct nvmev_submission_queue *sq = READ_ONCE(nvmev_vdev->sqes[sqid]);
 	int num_proc = new_db - old_db;
 	int seq;
 	int sq_entry = old_db;
@@ -478,12 +454,28 @@ int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
 
 	if (unlikely(!sq))
 		return old_db;
+
+#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
+	/*
+	 * Do not run the FTL again for a write stalled on a full write buffer
+	 * until the buffer is released enough to take it.
+	 */
+	if (sq->stall_buffer) {
+		if (!buffer_available(sq->stall_buffer, sq->stall_size)) {
+			__rearm_stalled_sq(sq);
+			return old_db;
+		}
+		sq->stall_buffer = NULL;
+	}
+#endif
+
 	if (unlikely(num_proc < 0))
 		num_proc += sq->queue_size;
+	num_proc = min(num_proc, max_proc);
 
 	for (seq = 0; seq < num_proc; seq++) {
 		size_t io_size;
-		if (!__nvmev_proc_io(sqid, sq_entry, &io_size))
+		if (!__nvmev_proc_io(sq, sq_entry, &io_size))
 			break;
 
 		if (++sq_entry == sq->queue_size) {
@@ -493,6 +485,10 @@ int nvmev_proc_io_sq(int sqid, int new_db, int old_db)
 		sq->stat.nr_in_flight++;
 		sq->stat.total_io += io_size;
 	}
+#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
+	if (sq->stall_buffer)
+		__rearm_stalled_sq(sq);
+#endif
 	sq->stat.nr_dispatch++;
 	sq->stat.max_nr_in_flight = max_t(int, sq->stat.max_nr_in_flight, sq->stat.nr_in_flight);
 
@@ -523,7 +519,8 @@ void nvmev_proc_io_cq(int cqid, int new_db, int old_db)
 		cq->cq_tail = cq->queue_size - 1;
 }
 
-static void __fill_cq_result(struct nvmev_io_work *w)
+static void __fill_cq_result(struct nvmev_io_worker *worker, struct nvmev_io_work *w,
+			     unsigned long long nsecs)
 {
 	int sqid = w->sqid;
 	int cqid = w->cqid;
@@ -533,9 +530,16 @@ static void __fill_cq_result(struct nvmev_io_work *w)
 	unsigned int result0 = w->result0;
 	unsigned int result1 = w->result1;
 
-	struct nvmev_completion_queue *cq = nvmev_vdev->cqes[cqid];
-	int cq_head = cq->cq_head;
-	struct nvme_completion *cqe = &cq_entry(cq_head);
+	struct nvmev_completion_queue *cq = READ_ONCE(nvmev_vdev->cqes[cqid]);
+	int cq_head;
+	struct nvme_completion *cqe;
+
+	/* The host deleted the CQ with the request in flight; nowhere to post it */
+	if (unlikely(!cq))
+		return;
+
+	cq_head = cq->cq_head;
+	cqe = &cq_entry(cq_head);
 
 	spin_lock(&cq->entry_lock);
 	cqe->command_id = command_id;
@@ -552,179 +556,745 @@ static void __fill_cq_result(struct nvmev_io_work *w)
 
 	cq->cq_head = cq_head;
 	cq->interrupt_ready = true;
+	if (cq->nr_coalesced++ == 0)
+		cq->nsecs_coalesce_start = nsecs;
 	spin_unlock(&cq->entry_lock);
+
+	__set_bit(cqid, worker->irq_pending);
 }
 
-static int nvmev_io_worker(void *data)
+/* Drop a reference on the DMA copies of @w; the last one marks it copied */
+static void __put_dma_copy(struct nvmev_io_work *w)
 {
-	struct nvmev_io_worker *worker = (struct nvmev_io_worker *)data;
-	struct nvmev_ns *ns;
+	if (!atomic_dec_and_test(&w->nr_dma_pending))
+		return;
 
-#ifdef PERF_DEBUG
-	static unsigned long long intr_clock[NR_MAX_IO_QUEUE + 1];
-	static unsigned long long intr_counter[NR_MAX_IO_QUEUE + 1];
+	w->nsecs_copy_done = nvmev_get_clock();
+	smp_store_release(&w->is_copied, true);
+	__settle_req(w);
+	__wake_io_worker(w->worker);
 
-	unsigned long long prev_clock;
-#endif
+	/* Nothing of @w or its io worker is touched from here on */
+	atomic_dec(&nr_dma_reqs);
+}
 
-	NVMEV_INFO("%s started on cpu %d (node %d)\n", worker->thread_name, smp_processor_id(),
-		   cpu_to_node(smp_processor_id()));
+static void __dma_copy_done(void *param, const struct dmaengine_result *result)
+{
+	struct nvmev_io_work *w = param;
 
-	while (!kthread_should_stop()) {
-		unsigned long long curr_nsecs_wall = __get_wallclock();
-		unsigned long long curr_nsecs_local = local_clock();
-		long long delta = curr_nsecs_wall - curr_nsecs_local;
+	if (result && result->result != DMA_TRANS_NOERROR)
+		w->status = NVME_SC_DATA_XFER_ERROR;
 
-		volatile unsigned int curr = worker->io_seq;
-		int qidx;
+	__put_dma_copy(w);
+}
 
-		while (curr != -1) {
-			struct nvmev_io_work *w = &worker->work_queue[curr];
-			unsigned long long curr_nsecs = local_clock() + delta;
-			worker->latest_nsecs = curr_nsecs;
+/* Give up on the DMA copies of a request that waits this long for descriptors */
+#define DMA_STALL_TIMEOUT_NS (1000 * NSEC_PER_MSEC)
+
+/*
+ * Hand the extents of @w from w->dma_queued bytes on to the DMA engine. With
+ * io_dma_async, they are queued over the DMA channels and started at once,
+ * and the io worker goes on while they are copied.
+ * Returns false if the channels ran out of descriptors; the request is then
+ * resumed later by __retry_dma_copies().
+ */
+static bool __do_perform_io_using_dma(struct nvmev_io_work *w)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[w->sqid];
+	struct nvme_rw_command *cmd = &sq_entry(w->sq_entry).rw;
+	size_t offset = __cmd_io_offset(cmd);
+	size_t length = __cmd_io_size(cmd);
+	size_t skip = w->dma_queued;
+	struct nvmev_dptr_iter iter;
+	unsigned int status;
+	bool done = true;
+	size_t io_size;
+	u64 paddr;
 
-			if (w->is_completed == true) {
-				curr = w->next;
-				continue;
+	if (cmd->opcode != nvme_cmd_write && cmd->opcode != nvme_cmd_zone_append &&
+	    cmd->opcode != nvme_cmd_read)
+		return true;
+
+	/* The channels are going away with the module */
+	if (READ_ONCE(dma_stopping)) {
+		w->status = NVME_SC_DATA_XFER_ERROR;
+		return true;
+	}
+
+	nvmev_dptr_init(&iter, cmd->flags, cmd->prp1, cmd->prp2, length);
+
+	while ((io_size = nvmev_dptr_next(&iter, &paddr))) {
+		dma_addr_t src, dst;
+		int ret;
+
+		/* Skip what is already queued, down to the middle of an extent */
+		if (skip >= io_size) {
+			skip -= io_size;
+			offset += io_size;
+			continue;
+		}
+		if (paddr != NVMEV_DPTR_BIT_BUCKET)
+			paddr += skip;
+		offset += skip;
+		io_size -= skip;
+		skip = 0;
+
+		if (paddr == NVMEV_DPTR_BIT_BUCKET) {
+			if (cmd->opcode != nvme_cmd_read) {
+				iter.status = NVME_SC_SGL_INVALID_TYPE;
+				break;
 			}
+			offset += io_size;
+			w->dma_queued += io_size;
+			continue;
+		}
 
-			if (w->is_copied == false) {
-#ifdef PERF_DEBUG
-				w->nsecs_copy_start = local_clock() + delta;
-#endif
-				if (w->is_internal) {
-					;
-				} else if (io_using_dma) {
-					__do_perform_io_using_dma(w->sqid, w->sq_entry);
-				} else {
+		if (cmd->opcode == nvme_cmd_read) {
+			src = nvmev_vdev->config.storage_start + offset;
+			dst = paddr;
+		} else {
+			src = paddr;
+			dst = nvmev_vdev->config.storage_start + offset;
+		}
+
+		if (io_dma_async) {
+			atomic_inc(&w->nr_dma_pending);
+			ret = ioat_dma_submit_async(src, dst, io_size, __dma_copy_done, w);
+			if (ret)
+				atomic_dec(&w->nr_dma_pending);
+		} else {
+			ret = ioat_dma_submit(src, dst, io_size);
+		}
+
+		if (ret == -EBUSY) {
+			done = false;
+			break;
+		} else if (ret) {
+			w->status = NVME_SC_DATA_XFER_ERROR;
+			break;
+		}
+
+		offset += io_size;
+		w->dma_queued += io_size;
+	}
+
+	/* Start the queued copies, which also frees up descriptors to retry with */
+	if (io_dma_async)
+		ioat_dma_issue_pending();
+
+	/* A malformed data pointer fails the command */
+	status = nvmev_dptr_final(&iter);
+	if (status != NVME_SC_SUCCESS)
+		w->status = status;
+
+	return done;
+}
+
+/* Resume the DMA copies that ran out of descriptors, without blocking the io worker */
+static bool __retry_dma_copies(struct nvmev_io_worker *worker)
+{
+	unsigned int *link = &worker->dma_stalled_seq;
+	unsigned int curr = *link;
+
+	if (curr == -1)
+		return false;
+
+	while (curr != -1) {
+		struct nvmev_io_work *w = __io_work(worker, curr);
+		unsigned int next = w->next;
+
+		if (__do_perform_io_using_dma(w)) {
+			*link = next;
+			__put_dma_copy(w);
+		} else if (nvmev_get_host_clock() - w->nsecs_dma_stalled > DMA_STALL_TIMEOUT_NS) {
+			NVMEV_ERROR("%s: no DMA descriptors for %u\n", worker->thread_name, w->id);
+			w->status = NVME_SC_DATA_XFER_ERROR;
+			*link = next;
+			__put_dma_copy(w);
+		} else {
+			link = &w->next;
+		}
+		curr = next;
+	}
+
+	return true;
+}
+
+static void __do_copy(struct nvmev_io_worker *worker, struct nvmev_io_work *w)
+{
+	w->nsecs_copy_start = nvmev_get_clock();
+
+	if (io_using_dma) {
+		/* Held until all the DMA copies are queued */
+		w->worker = worker;
+		w->dma_queued = 0;
+		atomic_set(&w->nr_dma_pending, 1);
+		atomic_inc(&nr_dma_reqs);
+		if (__do_perform_io_using_dma(w)) {
+			__put_dma_copy(w);
+		} else {
+			/* Keep the request pending until descriptors free up */
+			w->nsecs_dma_stalled = nvmev_get_host_clock();
+			w->next = worker->dma_stalled_seq;
+			worker->dma_stalled_seq = w->id;
+		}
+	} else {
+		unsigned int status = NVME_SC_SUCCESS;
 #if (BASE_SSD == KV_PROTOTYPE)
-					struct nvmev_submission_queue *sq =
-						nvmev_vdev->sqes[w->sqid];
-					ns = &nvmev_vdev->ns[0];
-					if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
-						w->result0 = ns->perform_io_cmd(
-							ns, &sq_entry(w->sq_entry), &(w->status));
-					} else {
-						__do_perform_io(w->sqid, w->sq_entry);
-					}
-#else 
-					__do_perform_io(w->sqid, w->sq_entry);
-#endif
-				}
+		struct nvmev_submission_queue *sq = nvmev_vdev->sqes[w->sqid];
+		struct nvmev_ns *ns = &nvmev_vdev->ns[0];
 
-#ifdef PERF_DEBUG
-				w->nsecs_copy_done = local_clock() + delta;
+		if (ns->identify_io_cmd(ns, sq_entry(w->sq_entry))) {
+			w->result0 = ns->perform_io_cmd(ns, &sq_entry(w->sq_entry), &(w->status));
+		} else {
+			status = __do_perform_io(w->sqid, w->sq_entry);
+		}
+#else
+		status = __do_perform_io(w->sqid, w->sq_entry);
 #endif
-				w->is_copied = true;
 
-				NVMEV_DEBUG_VERBOSE("%s: copied %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
-			}
+		/* A malformed data pointer fails the command */
+		if (status != NVME_SC_SUCCESS)
+			w->status = status;
 
-			if (w->nsecs_target <= curr_nsecs) {
-				if (w->is_internal) {
-#if (SUPPORTED_SSD_TYPE(CONV) || SUPPORTED_SSD_TYPE(ZNS))
-					buffer_release((struct buffer *)w->write_buffer,
-						       w->buffs_to_release);
-#endif
-				} else {
-					__fill_cq_result(w);
-				}
+		w->nsecs_copy_done = nvmev_get_clock();
+		w->is_copied = true;
+		__settle_req(w);
+	}
+
+	NVMEV_DEBUG_VERBOSE("%s: copied %u, %d %d %d\n", worker->thread_name, w->id,
+		    w->sqid, w->cqid, w->sq_entry);
+}
+
+static inline void __lat_hist_add(struct nvmev_lat_hist *hist, unsigned long long nsecs)
+{
+	hist->nr++;
+	hist->sum += nsecs;
+	if (nsecs > hist->max)
+		hist->max = nsecs;
+	hist->buckets[nvmev_lat_bucket(nsecs)]++;
+}
+
+static inline unsigned int __lat_op(unsigned int opcode)
+{
+	switch (opcode) {
+	case nvme_cmd_read:
+		return NVMEV_LAT_OP_READ;
+	case nvme_cmd_write:
+		return NVMEV_LAT_OP_WRITE;
+	case nvme_cmd_flush:
+		return NVMEV_LAT_OP_FLUSH;
+	default:
+		return NVMEV_LAT_OP_OTHER;
+	}
+}
+
+static void __record_latency(struct nvmev_io_worker *worker, struct nvmev_io_work *w)
+{
+	struct nvmev_lat_stat *lat = worker->lat;
+	struct nvmev_lat_hist *hist;
+	unsigned int reset_gen = READ_ONCE(nvmev_vdev->lat_reset_gen);
+	unsigned long long nsecs = w->nsecs_cq_filled - w->nsecs_start;
+
+	/* Not recorded if the histograms could not be allocated */
+	if (unlikely(!lat))
+		return;
+	hist = lat->hist;
+
+	if (unlikely(lat->reset_gen != reset_gen)) {
+		memset(lat->hist, 0, sizeof(lat->hist));
+		smp_wmb(); /* Cleared before readers take the histograms again */
+		WRITE_ONCE(lat->reset_gen, reset_gen);
+	}
+
+	__lat_hist_add(&hist[LAT_HIST_STAGE(NVMEV_LAT_ENQUEUE)], w->nsecs_enqueue - w->nsecs_start);
+	__lat_hist_add(&hist[LAT_HIST_STAGE(NVMEV_LAT_COPY_START)],
+		       w->nsecs_copy_start - w->nsecs_start);
+	__lat_hist_add(&hist[LAT_HIST_STAGE(NVMEV_LAT_COPY_DONE)],
+		       w->nsecs_copy_done - w->nsecs_start);
+	__lat_hist_add(&hist[LAT_HIST_STAGE(NVMEV_LAT_CQ_FILLED)], nsecs);
+	__lat_hist_add(&hist[LAT_HIST_STAGE(NVMEV_LAT_LATENESS)],
+		       w->nsecs_cq_filled - w->nsecs_target);
+	__lat_hist_add(&hist[LAT_HIST_OP(__lat_op(w->opcode))], nsecs);
+	__lat_hist_add(&hist[LAT_HIST_SQ(w->sqid)], nsecs);
+}
+
+static void __complete_reqs(struct nvmev_io_worker *worker, unsigned int *nr_reclaimed)
+{
+	unsigned long long curr_nsecs = nvmev_get_clock();
+	struct rb_node *node = rb_first_cached(&worker->io_tree);
+
+	while (node) {
+		struct nvmev_io_work *w = rb_entry(node, struct nvmev_io_work, node);
+		unsigned int entry = w->id;
+		struct rb_node *next;
+
+		if (w->nsecs_target > curr_nsecs)
+			break;
+
+		/* Asynchronous DMA copies may still be in flight */
+		if (!smp_load_acquire(&w->is_copied)) {
+			node = rb_next(node);
+			continue;
+		}
+
+		__fill_cq_result(worker, w, curr_nsecs);
+
+		NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, entry,
+			    w->sqid, w->cqid, w->sq_entry);
+
+		w->nsecs_cq_filled = nvmev_get_clock();
+		__record_latency(worker, w);
+
+		next = rb_next(node);
+		rb_erase_cached(node, &worker->io_tree);
+		__ring_put(&worker->reclaim, (*nr_reclaimed)++, entry);
+		node = next;
+	}
+}
+
+/*
+ * Hold the interrupt of @cq back while fewer completions than the aggregation
+ * threshold are posted, up to the aggregation time. An aggregation time of 0
+ * means no delay.
+ */
+static bool __irq_coalesced(struct nvmev_completion_queue *cq, unsigned long long nsecs)
+{
+	unsigned int time = nvmev_vdev->irq_coalesce_time;
+
+	if (time == 0)
+		return false;
+
+	if (cq->irq_vector <= NR_MAX_IO_QUEUE &&
+	    test_bit(cq->irq_vector, nvmev_vdev->irq_coalesce_disabled))
+		return false;
 
-				NVMEV_DEBUG_VERBOSE("%s: completed %u, %d %d %d\n", worker->thread_name, curr,
-					    w->sqid, w->cqid, w->sq_entry);
-
-#ifdef PERF_DEBUG
-				w->nsecs_cq_filled = local_clock() + delta;
-				trace_printk("%llu %llu %llu %llu %llu %llu\n", w->nsecs_start,
-					     w->nsecs_enqueue - w->nsecs_start,
-					     w->nsecs_copy_start - w->nsecs_start,
-					     w->nsecs_copy_done - w->nsecs_start,
-					     w->nsecs_cq_filled - w->nsecs_start,
-					     w->nsecs_target - w->nsecs_start);
+	return READ_ONCE(cq->nr_coalesced) <= nvmev_vdev->irq_coalesce_thr &&
+	       nsecs < cq->nsecs_coalesce_start + time * 100000ULL;
+}
+
+/* Whether threads other than the owner io worker may copy its requests */
+static inline bool __can_share_copies(void)
+{
+#if (BASE_SSD == KV_PROTOTYPE)
+	return false; /* KV commands run the FTL while being copied */
+#else
+	/* DMA channels are not shared among the io workers */
+	return !io_using_dma;
 #endif
-				mb(); /* Reclaimer shall see after here */
-				w->is_completed = true;
-			}
+}
+
+/*
+ * Copy the data of a request pending at one of @nr_victims io workers from
+ * @first on. Only the copy is taken over; the request is handed back through
+ * @stolen_seq so that its owner completes it in order with the other
+ * requests in its @io_tree.
+ */
+static bool __steal_copy(unsigned int first, unsigned int nr_victims)
+{
+	unsigned int nr_io_workers = nvmev_vdev->config.nr_io_workers;
+	unsigned int i;
+
+	for (i = 0; i < nr_victims; i++) {
+		struct nvmev_io_worker *victim =
+			&nvmev_vdev->io_workers[(first + i) % nr_io_workers];
+		struct nvmev_io_work *w;
+		unsigned int entry;
+
+		if (READ_ONCE(victim->copy_seq) == -1 || !spin_trylock(&victim->copy_lock))
+			continue;
+		entry = __dequeue_copy_locked(victim);
+		spin_unlock(&victim->copy_lock);
+
+		if (entry == -1)
+			continue;
+
+		w = __io_work(victim, entry);
+		__do_copy(victim, w);
+
+		spin_lock(&victim->copy_lock);
+		w->next = victim->stolen_seq;
+		WRITE_ONCE(victim->stolen_seq, entry);
+		spin_unlock(&victim->copy_lock);
+
+		__wake_io_worker(victim);
+		return true;
+	}
+
+	return false;
+}
+
+/* Take back the requests copied by other io workers */
+static bool __collect_stolen(struct nvmev_io_worker *worker)
+{
+	unsigned int curr;
+
+	if (READ_ONCE(worker->stolen_seq) == -1)
+		return false;
+
+	spin_lock(&worker->copy_lock);
+	curr = worker->stolen_seq;
+	WRITE_ONCE(worker->stolen_seq, -1);
+	spin_unlock(&worker->copy_lock);
+
+	while (curr != -1) {
+		struct nvmev_io_work *w = __io_work(worker, curr);
+		unsigned int next = w->next;
+
+		__insert_req_sorted(curr, worker, w->nsecs_target);
+		curr = next;
+	}
+
+	return true;
+}
+
+/*
+ * Park an idle io worker until the next request in @io_tree is due, or until
+ * the dispatcher hands over a new request.
+ */
+static void __io_worker_sleep(struct nvmev_io_worker *worker, unsigned long long nsecs)
+{
+	struct rb_node *node = rb_first_cached(&worker->io_tree);
+
+	set_current_state(TASK_INTERRUPTIBLE);
+	smp_store_mb(worker->is_idle, true);
+
+	if (!__ring_empty(&worker->submission) || READ_ONCE(worker->stolen_seq) != -1 ||
+	    kthread_should_stop()) {
+		__set_current_state(TASK_RUNNING);
+	} else if (node) {
+		struct nvmev_io_work *w = rb_entry(node, struct nvmev_io_work, node);
+		ktime_t timeout = ns_to_ktime(
+			nvmev_clock_to_host(w->nsecs_target > nsecs ? w->nsecs_target - nsecs : 0));
+
+		schedule_hrtimeout_range(&timeout, 0, HRTIMER_MODE_REL);
+	} else {
+		schedule();
+	}
+
+	WRITE_ONCE(worker->is_idle, false);
+}
+
+/*
+ * In the event-driven mode, jump the virtual clock to the next completion
+ * once all the io workers have nothing to do but wait for it.
+ */
+static bool __skip_idle_time(struct nvmev_io_worker *worker, bool busy)
+{
+	struct rb_node *node = rb_first_cached(&worker->io_tree);
+	unsigned long long nsecs_next = U64_MAX;
+	s64 nsecs_skipped;
+	unsigned long long nsecs;
+	unsigned int i;
+
+	if (busy || READ_ONCE(worker->copy_seq) != -1) {
+		WRITE_ONCE(worker->nsecs_next_due, 0);
+		return false;
+	}
+
+	WRITE_ONCE(worker->nsecs_next_due,
+		   node ? rb_entry(node, struct nvmev_io_work, node)->nsecs_target : U64_MAX);
+	smp_mb();
+
+	/* Requests on their way to an io_tree are not in any nsecs_next_due yet */
+	if (atomic_read(&nvmev_clock.nr_unsettled))
+		return false;
+	smp_rmb(); /* The due times published before the requests settled */
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		unsigned long long nsecs_due = READ_ONCE(nvmev_vdev->io_workers[i].nsecs_next_due);
 
-			curr = w->next;
+		if (nsecs_due == 0)
+			return false;
+		nsecs_next = min(nsecs_next, nsecs_due);
+	}
+
+	if (nsecs_next == U64_MAX)
+		return false;
+
+	/* Lose to another io worker skipping at the same time rather than skip twice */
+	nsecs_skipped = atomic64_read(&nvmev_clock.nsecs_skipped);
+	nsecs = nvmev_get_clock();
+	if (nsecs_next <= nsecs)
+		return false;
+
+	return atomic64_try_cmpxchg(&nvmev_clock.nsecs_skipped, &nsecs_skipped,
+				    nsecs_skipped + (nsecs_next - nsecs));
+}
+
+/*
+ * Wait for every io worker to start a new pass of its loop. A CQ unpublished
+ * before the call is no longer referenced by any of them after. Parked io
+ * workers are woken up to make the pass.
+ */
+void nvmev_quiesce_io_workers(void)
+{
+	unsigned int i;
+
+	smp_mb(); /* Pairs with smp_store_release() in nvmev_io_worker() */
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
+		unsigned long nr_passes = READ_ONCE(worker->nr_passes);
+
+		while (READ_ONCE(worker->nr_passes) == nr_passes) {
+			if (READ_ONCE(worker->is_idle))
+				wake_up_process(worker->task_struct);
+			cond_resched();
 		}
+	}
+}
 
-		for (qidx = 1; qidx <= nvmev_vdev->nr_cq; qidx++) {
-			struct nvmev_completion_queue *cq = nvmev_vdev->cqes[qidx];
+static int nvmev_io_worker(void *data)
+{
+	struct nvmev_io_worker *worker = (struct nvmev_io_worker *)data;
 
-#ifdef CONFIG_NVMEV_IO_WORKER_BY_SQ
-			if ((worker->id) != __get_io_worker(qidx))
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", worker->thread_name, smp_processor_id(),
+		   cpu_to_node(smp_processor_id()));
+
+	while (!kthread_should_stop()) {
+		unsigned int curr;
+		unsigned int nr_reclaimed = 0;
+		bool busy = false;
+		int qidx;
+
+		/* New requests go to the copy FIFO */
+		while (__ring_pop(&worker->submission, &curr)) {
+			__enqueue_copy(curr, worker);
+			busy = true;
+		}
+
+		if (__collect_stolen(worker))
+			busy = true;
+
+		if (io_using_dma && __retry_dma_copies(worker))
+			busy = true;
+
+		__complete_reqs(worker, &nr_reclaimed);
+
+		/* Copies are left to the copiers, if any */
+		while (!nvmev_vdev->config.nr_copiers && (curr = __dequeue_copy(worker)) != -1) {
+			struct nvmev_io_work *w = __io_work(worker, curr);
+
+			__do_copy(worker, w);
+			__insert_req_sorted(curr, worker, w->nsecs_target);
+
+			/* Do not hold back the requests that became due while copying */
+			__complete_reqs(worker, &nr_reclaimed);
+		}
+
+		/* Nothing left to copy here; help the io workers with copies piled up */
+		if (!nvmev_vdev->config.nr_copiers && nvmev_vdev->config.nr_io_workers > 1 &&
+		    __can_share_copies() &&
+		    __steal_copy(worker->id + 1, nvmev_vdev->config.nr_io_workers - 1))
+			busy = true;
+
+		/* Return the completed entries to the dispatcher in a batch */
+		if (nr_reclaimed) {
+			__ring_publish(&worker->reclaim, nr_reclaimed);
+			busy = true;
+		}
+
+		/* Visit only the cqs this worker has posted completions to */
+		for_each_set_bit(qidx, worker->irq_pending, NR_MAX_IO_QUEUE + 1) {
+			struct nvmev_completion_queue *cq = READ_ONCE(nvmev_vdev->cqes[qidx]);
+
+			if (cq == NULL || !cq->irq_enabled) {
+				__clear_bit(qidx, worker->irq_pending);
 				continue;
-#endif
-			if (cq == NULL || !cq->irq_enabled)
+			}
+
+			if (__irq_coalesced(cq, nvmev_get_clock()))
 				continue;
 
 			if (spin_trylock(&cq->irq_lock)) {
+				__clear_bit(qidx, worker->irq_pending);
 				if (cq->interrupt_ready == true) {
-#ifdef PERF_DEBUG
-					prev_clock = local_clock();
-#endif
+					spin_lock(&cq->entry_lock);
 					cq->interrupt_ready = false;
+					cq->nr_coalesced = 0;
+					spin_unlock(&cq->entry_lock);
 					nvmev_signal_irq(cq->irq_vector);
-
-#ifdef PERF_DEBUG
-					intr_clock[qidx] += (local_clock() - prev_clock);
-					intr_counter[qidx]++;
-
-					if (intr_counter[qidx] > 1000) {
-						NVMEV_DEBUG("Intr %d: %llu\n", qidx,
-							    intr_clock[qidx] / intr_counter[qidx]);
-						intr_clock[qidx] = 0;
-						intr_counter[qidx] = 0;
-					}
-#endif
 				}
 				spin_unlock(&cq->irq_lock);
 			}
 		}
+
+		/* No CQ looked up so far is used past here */
+		smp_store_release(&worker->nr_passes, worker->nr_passes + 1);
+
+		if (nvmev_clock.skip_idle && __skip_idle_time(worker, busy))
+			continue;
+
+		/*
+		 * Poll while busy, and park once idle for @idle_poll_us. The idle
+		 * time is on the host clock, which the virtual clock may outrun.
+		 */
+		if (busy) {
+			worker->nsecs_last_busy = nvmev_get_host_clock();
+		} else if (nvmev_vdev->config.idle_poll_us &&
+			   bitmap_empty(worker->irq_pending, NR_MAX_IO_QUEUE + 1) &&
+			   nvmev_get_host_clock() - worker->nsecs_last_busy >=
+				   nvmev_vdev->config.idle_poll_us * 1000ULL) {
+			__io_worker_sleep(worker, nvmev_get_clock());
+		}
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int nvmev_copier(void *data)
+{
+	struct nvmev_copier *copier = (struct nvmev_copier *)data;
+	unsigned long long nsecs_last_busy = nvmev_get_host_clock();
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", copier->thread_name, smp_processor_id(),
+		   cpu_to_node(smp_processor_id()));
+
+	while (!kthread_should_stop()) {
+		if (__steal_copy(copier->turn++, nvmev_vdev->config.nr_io_workers)) {
+			nsecs_last_busy = nvmev_get_host_clock();
+		} else if (nvmev_vdev->config.idle_poll_us &&
+			   nvmev_get_host_clock() - nsecs_last_busy >= nvmev_vdev->config.idle_poll_us * 1000ULL) {
+			ktime_t timeout = ns_to_ktime(nvmev_vdev->config.idle_max_latency_us * 1000ULL);
+
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout_range(&timeout, 0, HRTIMER_MODE_REL);
+		}
+
 		cond_resched();
 	}
 
 	return 0;
 }
 
+static void __copiers_init(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int i;
+
+	if (nvmev_vdev->config.nr_copiers && !__can_share_copies()) {
+		NVMEV_ERROR("Copiers are not supported with DMA or KV, let io workers copy data\n");
+		nvmev_vdev->config.nr_copiers = 0;
+	}
+
+	nvmev_vdev->copiers =
+		kcalloc(sizeof(struct nvmev_copier), nvmev_vdev->config.nr_copiers, GFP_KERNEL);
+
+	for (i = 0; i < nvmev_vdev->config.nr_copiers; i++) {
+		struct nvmev_copier *copier = &nvmev_vdev->copiers[i];
+
+		copier->id = i;
+		copier->turn = i;
+		snprintf(copier->thread_name, sizeof(copier->thread_name), "nvmev_copier_%d", i);
+
+		copier->task_struct = kthread_create(nvmev_copier, copier, "%s", copier->thread_name);
+
+		kthread_bind(copier->task_struct, nvmev_vdev->config.cpu_nr_copiers[i]);
+		wake_up_process(copier->task_struct);
+	}
+}
+
+static void __copiers_final(struct nvmev_dev *nvmev_vdev)
+{
+	unsigned int i;
+
+	for (i = 0; i < nvmev_vdev->config.nr_copiers; i++) {
+		struct nvmev_copier *copier = &nvmev_vdev->copiers[i];
+
+		if (!IS_ERR_OR_NULL(copier->task_struct)) {
+			kthread_stop(copier->task_struct);
+		}
+	}
+
+	kfree(nvmev_vdev->copiers);
+}
+
 void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev)
 {
-	unsigned int i, worker_id;
+	unsigned int worker_id;
 
 	nvmev_vdev->io_workers =
 		kcalloc(sizeof(struct nvmev_io_worker), nvmev_vdev->config.nr_io_workers, GFP_KERNEL);
-	nvmev_vdev->io_worker_turn = 0;
 
 	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_io_workers; worker_id++) {
 		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[worker_id];
 
-		worker->work_queue =
-			kzalloc(sizeof(struct nvmev_io_work) * NR_MAX_PARALLEL_IO, GFP_KERNEL);
-		for (i = 0; i < NR_MAX_PARALLEL_IO; i++) {
-			worker->work_queue[i].next = i + 1;
-			worker->work_queue[i].prev = i - 1;
-		}
-		worker->work_queue[NR_MAX_PARALLEL_IO - 1].next = -1;
+		worker->nr_works = 0;
+		worker->next_fresh = 0;
+		__grow_work_pool(worker);
 		worker->id = worker_id;
-		worker->free_seq = 0;
-		worker->free_seq_end = NR_MAX_PARALLEL_IO - 1;
-		worker->io_seq = -1;
-		worker->io_seq_end = -1;
+
+		worker->submission.entries =
+			kcalloc(NR_MAX_PARALLEL_IO, sizeof(unsigned int), GFP_KERNEL);
+		worker->submission.size = NR_MAX_PARALLEL_IO;
+		worker->submission.head = 0;
+		worker->submission.tail = 0;
+		worker->submission.head_cache = 0;
+
+		worker->reclaim.entries =
+			kcalloc(NR_MAX_PARALLEL_IO, sizeof(unsigned int), GFP_KERNEL);
+		worker->reclaim.size = NR_MAX_PARALLEL_IO;
+		worker->reclaim.head = 0;
+		worker->reclaim.tail = 0;
+		worker->reclaim.head_cache = 0;
+
+		spin_lock_init(&worker->copy_lock);
+		worker->copy_seq = -1;
+		worker->copy_seq_end = -1;
+		worker->stolen_seq = -1;
+		worker->spare_entry = -1;
+		worker->dma_stalled_seq = -1;
+		worker->io_tree = RB_ROOT_CACHED;
+		bitmap_zero(worker->irq_pending, NR_MAX_IO_QUEUE + 1);
+
+		worker->lat = vzalloc(sizeof(struct nvmev_lat_stat));
+		if (worker->lat)
+			worker->lat->reset_gen = nvmev_vdev->lat_reset_gen;
+		else
+			NVMEV_ERROR("No memory for the latency histograms of io worker %u\n", worker_id);
+	}
+
+	/* Start the io workers once all of them are ready to be stolen from */
+	for (worker_id = 0; worker_id < nvmev_vdev->config.nr_io_workers; worker_id++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[worker_id];
 
 		snprintf(worker->thread_name, sizeof(worker->thread_name), "nvmev_io_worker_%d", worker_id);
 
 		worker->task_struct = kthread_create(nvmev_io_worker, worker, "%s", worker->thread_name);
+		/* Late DMA completions may still wake it up after kthread_stop() */
+		if (!IS_ERR(worker->task_struct))
+			get_task_struct(worker->task_struct);
 
 		kthread_bind(worker->task_struct, nvmev_vdev->config.cpu_nr_io_workers[worker_id]);
 		wake_up_process(worker->task_struct);
 	}
+
+	__copiers_init(nvmev_vdev);
 }
 
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
-	unsigned int i;
+	unsigned int i, j;
+
+	/* Copiers work on the queues of the io workers */
+	__copiers_final(nvmev_vdev);
+
+	/*
+	 * Let the DMA copies in flight complete while the io workers are still
+	 * there to be woken up, and have no more queued. Whatever has not
+	 * completed in DMA_STALL_TIMEOUT_NS is terminated.
+	 */
+	if (io_using_dma) {
+		unsigned long long nsecs = nvmev_get_host_clock();
+
+		WRITE_ONCE(dma_stopping, true);
+		while (atomic_read(&nr_dma_reqs) &&
+		       nvmev_get_host_clock() - nsecs < DMA_STALL_TIMEOUT_NS)
+			usleep_range(100, 200);
+		ioat_dma_terminate();
+	}
 
 	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
 		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
@@ -732,8 +1302,23 @@ void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev)
 		if (!IS_ERR_OR_NULL(worker->task_struct)) {
 			kthread_stop(worker->task_struct);
 		}
+	}
+
+	/* Copies queued by the io workers right before they stopped point into the work pools */
+	if (io_using_dma)
+		ioat_dma_terminate();
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_io_worker *worker = &nvmev_vdev->io_workers[i];
+
+		if (!IS_ERR_OR_NULL(worker->task_struct))
+			put_task_struct(worker->task_struct);
 
-		kfree(worker->work_queue);
+		vfree(worker->lat);
+		kfree(worker->reclaim.entries);
+		kfree(worker->submission.entries);
+		for (j = 0; j < worker->nr_works >> IO_WORK_CHUNK_SHIFT; j++)
+			kfree(worker->work_chunks[j]);
 	}
 
 	kfree(nvmev_vdev->io_workers);
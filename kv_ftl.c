@@ -6,6 +6,8 @@
 
 #include "nvmev.h"
 #include "kv_ftl.h"
+#include "copy.h"
+#include "dptr.h"
 
 static const struct allocator_ops append_only_ops = {
 	.init = append_only_allocator_init,
@@ -19,11 +21,6 @@ static const struct allocator_ops bitmap_ops = {
 	.kill = bitmap_kill,
 };
 
-static inline unsigned long long __get_wallclock(void)
-{
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
-}
-
 static size_t __cmd_io_size(struct nvme_rw_command *cmd)
 {
 	NVMEV_DEBUG("%d lba %llu length %d, %llx %llx\n", cmd->opcode, cmd->slba, cmd->length,
@@ -506,15 +503,11 @@ static unsigned int __do_perform_kv_io(struct kv_ftl *kv_ftl, struct nvme_kv_com
 				       unsigned int *status)
 {
 	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
-	size_t mem_offs = 0;
+	size_t length;
 	size_t new_offset = 0;
 	struct mapping_entry entry;
 	int is_insert = 0;
+	unsigned int ret;
 
 	entry = get_mapping_entry(kv_ftl, cmd);
 	offset = entry.mem_offset;
@@ -580,52 +573,12 @@ static unsigned int __do_perform_kv_io(struct kv_ftl *kv_ftl, struct nvme_kv_com
 
 		return 0;
 	}
-	remaining = length;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = kv_io_cmd_value_prp(cmd, 1);
-		} else if (prp_offs == 2) {
-			paddr = kv_io_cmd_value_prp(cmd, 2);
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) { // 일반 block io면 언제 여기에 해당?
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-		if (cmd.common.opcode == nvme_cmd_kv_store) {
-			memcpy(nvmev_vdev->storage_mapped + offset, vaddr + mem_offs, io_size);
-		} else if (cmd.common.opcode == nvme_cmd_kv_retrieve) {
-			memcpy(vaddr + mem_offs, nvmev_vdev->storage_mapped + offset, io_size);
-		} else {
-			NVMEV_ERROR("Wrong KV Command passed to NVMeVirt!!\n");
-		}
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
-	}
-
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
+	ret = nvmev_dptr_copy(cmd.common.flags, kv_io_cmd_value_prp(cmd, 1),
+			      kv_io_cmd_value_prp(cmd, 2), nvmev_vdev->storage_mapped + offset, length,
+			      cmd.common.opcode == nvme_cmd_kv_store ? NVMEV_COPY_WRITE :
+								       NVMEV_COPY_READ);
+	if (ret != NVME_SC_SUCCESS)
+		*status = ret;
 
 	if (is_insert == 1) { // need to make new mapping
 		new_mapping_entry(kv_ftl, cmd, new_offset);
@@ -691,13 +644,8 @@ static unsigned int __do_perform_kv_batched_io(struct kv_ftl *kv_ftl, int opcode
 static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_command cmd,
 					  unsigned int *status)
 {
-	size_t offset;
-	size_t length, remaining;
-	int prp_offs = 0;
-	int prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
-	size_t mem_offs = 0;
+	size_t length;
+	unsigned int ret;
 	int i;
 	struct payload_format *payload;
 	char *buffer = NULL;
@@ -714,46 +662,11 @@ static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_
 
 	//printk("kv_batch %d %d", sub_cmd_cnt, length);
 
-	remaining = length;
-	offset = 0;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = kv_io_cmd_value_prp(cmd, 1);
-		} else if (prp_offs == 2) {
-			paddr = kv_io_cmd_value_prp(cmd, 2);
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) { // 일반 block io면 언제 여기에 해당?
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-
-		NVMEV_DEBUG("Value write length %lu to position %lu, io size: %ld, mem_off: %lu\n",
-			    remaining, offset, io_size, mem_offs);
-		memcpy(buffer + offset, vaddr + mem_offs, io_size);
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
+	ret = nvmev_dptr_copy(cmd.common.flags, kv_io_cmd_value_prp(cmd, 1),
+			      kv_io_cmd_value_prp(cmd, 2), buffer, length, NVMEV_COPY_WRITE);
+	if (ret != NVME_SC_SUCCESS) {
+		*status = ret;
+		goto out;
 	}
 
 	/* perform KV IO for sub-payload */
@@ -784,9 +697,7 @@ static unsigned int __do_perform_kv_batch(struct kv_ftl *kv_ftl, struct nvme_kv_
 
 	NVMEV_DEBUG("finished kv_batch with %d sub-commands", sub_cmd_cnt);
 
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
-
+out:
 	if (value != NULL)
 		kfree(value);
 
@@ -847,10 +758,7 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	int pos = 0, keylen = 16, buf_offset = 4, nr_keys = 0;
 	unsigned int key;
 	bool full = false, end = false;
-	size_t remaining, mem_offs = 0, offset;
-	int prp_offs = 0, prp2_offs = 0;
-	u64 paddr;
-	u64 *paddr_list = NULL;
+	unsigned int ret;
 
 	if (handle == NULL) {
 		NVMEV_ERROR("Invalid Iterator Handle");
@@ -892,53 +800,14 @@ static unsigned int kv_iter_read(struct kv_ftl *kv_ftl, struct nvme_kv_command c
 	NVMEV_DEBUG("Iterator read done, buf_offset %d, pos %d", buf_offset, pos);
 	handle->current_pos = pos;
 
-	/* Writing buffer to PRP */
-	remaining = buf_offset;
-	offset = 0;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = kv_io_cmd_value_prp(cmd, 1);
-		} else if (prp_offs == 2) {
-			paddr = kv_io_cmd_value_prp(cmd, 2);
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-
-		NVMEV_DEBUG(
-			"Buffer transfer, length %lu from position %lu, io size: %ld, mem_off: %lu\n",
-			remaining, offset, io_size, mem_offs);
-		memcpy(vaddr + mem_offs, handle->buf + offset, io_size);
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
+	/* Writing buffer to the data pointer */
+	ret = nvmev_dptr_copy(cmd.common.flags, kv_io_cmd_value_prp(cmd, 1),
+			      kv_io_cmd_value_prp(cmd, 2), handle->buf, buf_offset, NVMEV_COPY_READ);
+	if (ret != NVME_SC_SUCCESS) {
+		*status = ret;
+		return buf_offset;
 	}
 
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
-
 	*status = 0;
 	if (end) {
 		*status = 0x393;
@@ -972,7 +841,7 @@ bool kv_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req, struct
 	case nvme_cmd_read:
 		ret->nsecs_target = __schedule_io_units(
 			cmd->common.opcode, cmd->rw.slba,
-			__cmd_io_size((struct nvme_rw_command *)cmd), __get_wallclock());
+			__cmd_io_size((struct nvme_rw_command *)cmd), nvmev_get_clock());
 		break;
 	case nvme_cmd_flush:
 		ret->nsecs_target = __schedule_flush(req);
@@ -982,9 +851,9 @@ bool kv_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req, struct
 	case nvme_cmd_kv_batch:
 		ret->nsecs_target = __schedule_io_units(
 			cmd->common.opcode, 0, cmd_value_length(*((struct nvme_kv_command *)cmd)),
-			__get_wallclock());
+			nvmev_get_clock());
 		NVMEV_INFO("%d, %llu, %llu\n", cmd_value_length(*((struct nvme_kv_command *)cmd)),
-			   __get_wallclock(), ret->nsecs_target);
+			   nvmev_get_clock(), ret->nsecs_target);
 		break;
 	default:
 		NVMEV_ERROR("%s: command not implemented: %s (0x%x)\n", __func__,
@@ -1013,8 +882,7 @@ unsigned int kv_perform_nvme_io_cmd(struct nvmev_ns *ns, struct nvme_command *cm
 		return __do_perform_kv_io(kv_ftl, *kv_cmd, status);
 }
 
-void kv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-		       uint32_t cpu_nr_dispatcher)
+void kv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr)
 {
 	struct kv_ftl *kv_ftl;
 	int i;
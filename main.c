@@ -8,6 +8,8 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/clocksource.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
 
@@ -22,6 +24,7 @@
 #include "simple_ftl.h"
 #include "kv_ftl.h"
 #include "dma.h"
+#include "copy.h"
 
 /****************************************************************
  * Memory Layout
@@ -71,9 +74,21 @@ static unsigned int nr_io_units = 8;
 static unsigned int io_unit_shift = 12;
 
 static char *cpus;
+static unsigned int idle_poll_us = 0;
+static unsigned int idle_max_latency_us = 50;
+static unsigned int time_scale = 1;
+static bool time_skip = false;
+static char *copy_read = "auto";
+static char *copy_write = "auto";
+static unsigned int copy_bench_mb = 0;
+static unsigned int mdts = 0;
+static char *dma_channels;
 static unsigned int debug = 0;
 
-int io_using_dma = false;
+bool io_using_dma = false;
+bool io_dma_async = true;
+
+struct nvmev_clock nvmev_clock;
 
 static int set_parse_mem_param(const char *val, const struct kernel_param *kp)
 {
@@ -108,63 +123,259 @@ MODULE_PARM_DESC(nr_io_units, "Number of I/O units that operate in parallel");
 module_param(io_unit_shift, uint, 0444);
 MODULE_PARM_DESC(io_unit_shift, "Size of each I/O unit (2^)");
 module_param(cpus, charp, 0444);
-MODULE_PARM_DESC(cpus, "CPU list for process, completion(int.) threads, Seperated by Comma(,)");
+MODULE_PARM_DESC(cpus, "CPU list for process, completion(int.) threads, Seperated by Comma(,). "
+		       "Use Colon(:) to give multiple dispatchers, e.g., 0,1:2,3,4,5, "
+		       "and another Colon(:) to add copy threads, e.g., 0:1,2:3,4");
+module_param(idle_poll_us, uint, 0444);
+MODULE_PARM_DESC(idle_poll_us, "Time to keep polling after the last work before sleeping (usec), 0 to always poll");
+module_param(idle_max_latency_us, uint, 0444);
+MODULE_PARM_DESC(idle_max_latency_us, "Maximum latency to notice a new doorbell while sleeping (usec)");
+module_param(time_scale, uint, 0444);
+MODULE_PARM_DESC(time_scale, "Run the device clock this many times as fast as the host clock");
+module_param(time_skip, bool, 0444);
+MODULE_PARM_DESC(time_skip, "Skip the device clock over the time io workers only wait for completions");
+module_param(copy_read, charp, 0444);
+MODULE_PARM_DESC(copy_read, "Copy engine for reads: memcpy, nt, avx2, avx512, or auto for memcpy");
+module_param(copy_write, charp, 0444);
+MODULE_PARM_DESC(copy_write, "Copy engine for writes: memcpy, nt, avx2, avx512, or auto to pick the fastest");
+module_param(copy_bench_mb, uint, 0444);
+MODULE_PARM_DESC(copy_bench_mb, "Size of the copy engine benchmark (MiB), 0 for 4 times the last-level cache");
+module_param(mdts, uint, 0444);
+MODULE_PARM_DESC(mdts, "Maximum data transfer size as a power of 2 of 4 KiB pages, e.g., 10 for 4 MiB, "
+		       "0 for the default of the SSD model");
+module_param(dma_channels, charp, 0444);
+MODULE_PARM_DESC(dma_channels, "Copy data with these DMA memcpy channels, e.g., dma7chan0,dma7chan1, "
+			       "or all of them if empty");
+module_param_named(dma_async, io_dma_async, bool, 0444);
+MODULE_PARM_DESC(dma_async, "Overlap DMA copies with other requests instead of waiting for each");
 module_param(debug, uint, 0644);
 
-static void nvmev_proc_dbs(void)
+static inline void __update_eventidx(int dbs_idx)
+{
+	u32 *eis = nvmev_vdev->dbbuf_eis;
+
+	/*
+	 * Keep EventIdx right behind the processed doorbell so that the host
+	 * never has to ring the MMIO doorbell. The shadow doorbells are polled.
+	 */
+	if (eis)
+		WRITE_ONCE(eis[dbs_idx], nvmev_vdev->old_dbs[dbs_idx] - 1);
+}
+
+/*
+ * Fetch up to @max_proc commands from the submission queue @qid.
+ * Returns the number of commands fetched.
+ */
+static int __proc_io_sq(int qid, int max_proc)
+{
+	struct nvmev_submission_queue *sq = nvmev_vdev->sqes[qid];
+	u32 *dbs = nvmev_io_dbs();
+	int dbs_idx = qid * 2;
+	int new_db = READ_ONCE(dbs[dbs_idx]);
+	int old_db = nvmev_vdev->old_dbs[dbs_idx];
+	int nr_proc;
+
+	if (new_db == old_db || sq == NULL)
+		return 0;
+
+	nvmev_vdev->old_dbs[dbs_idx] = nvmev_proc_io_sq(qid, new_db, old_db, max_proc);
+	__update_eventidx(dbs_idx);
+
+	nr_proc = nvmev_vdev->old_dbs[dbs_idx] - old_db;
+	if (nr_proc < 0)
+		nr_proc += sq->queue_size;
+	return nr_proc;
+}
+
+/*
+ * Serve the submission queues in @pending for one arbitration round.
+ *
+ * With round robin, every SQ gets up to an arbitration burst of commands.
+ * With weighted round robin, the urgent class is served first, then the
+ * high, medium, and low classes get (weight + 1) commands each, spread over
+ * their SQs round-robin in bursts. SQs left with commands stay dirty in the
+ * doorbells and are picked up again in the next round.
+ */
+static int __arbitrate_sqs(struct nvmev_dispatcher *dispatcher, unsigned long *pending)
+{
+	DECLARE_BITMAP(sqs, NR_MAX_IO_QUEUE + 1);
+	int burst = INT_MAX;
+	int nr_fetched = 0;
+	int qid, prio;
+
+	if (nvmev_vdev->arb_burst != NVMEV_ARB_BURST_NO_LIMIT)
+		burst = 1 << nvmev_vdev->arb_burst;
+
+	if (!nvmev_vdev->arb_wrr) {
+		for_each_set_bit(qid, pending, NR_MAX_IO_QUEUE + 1)
+			nr_fetched += __proc_io_sq(qid, burst);
+		return nr_fetched;
+	}
+
+	for (prio = NVMEV_SQ_PRIO_URGENT; prio < NR_NVMEV_SQ_PRIO; prio++) {
+		int credits = (prio == NVMEV_SQ_PRIO_URGENT) ? INT_MAX :
+							       nvmev_vdev->arb_weights[prio] + 1;
+
+		bitmap_zero(sqs, NR_MAX_IO_QUEUE + 1);
+		for_each_set_bit(qid, pending, NR_MAX_IO_QUEUE + 1) {
+			struct nvmev_submission_queue *sq = nvmev_vdev->sqes[qid];
+
+			if (sq && sq->priority == prio)
+				__set_bit(qid, sqs);
+		}
+
+		if (prio == NVMEV_SQ_PRIO_URGENT) {
+			for_each_set_bit(qid, sqs, NR_MAX_IO_QUEUE + 1)
+				nr_fetched += __proc_io_sq(qid, burst);
+			continue;
+		}
+
+		qid = dispatcher->arb_last_qid[prio];
+		while (credits > 0 && !bitmap_empty(sqs, NR_MAX_IO_QUEUE + 1)) {
+			int nr_proc;
+
+			qid = find_next_bit(sqs, NR_MAX_IO_QUEUE + 1, qid + 1);
+			if (qid > NR_MAX_IO_QUEUE)
+				qid = find_first_bit(sqs, NR_MAX_IO_QUEUE + 1);
+
+			nr_proc = __proc_io_sq(qid, min(credits, burst));
+			if (nr_proc < min(credits, burst))
+				__clear_bit(qid, sqs); /* Drained */
+			credits -= nr_proc;
+			nr_fetched += nr_proc;
+		}
+		dispatcher->arb_last_qid[prio] = qid;
+	}
+
+	return nr_fetched;
+}
+
+/*
+ * Returns whether anything was done. SQs left dirty because they are blocked,
+ * e.g., on a full write buffer or on io workers out of entries, or doorbells
+ * of queues that do not exist, do not count; they are polled again, at the
+ * latest when the dispatcher wakes up from parking.
+ */
+static bool nvmev_proc_dbs(struct nvmev_dispatcher *dispatcher)
 {
+	u32 *dbs = nvmev_io_dbs();
+	DECLARE_BITMAP(dirty, NR_MAX_IO_QUEUE + 1);
 	int qid;
 	int dbs_idx;
 	int new_db;
 	int old_db;
 
+	bool busy = false;
+
 	// Admin queue
-	new_db = nvmev_vdev->dbs[0];
-	if (new_db != nvmev_vdev->old_dbs[0]) {
-		nvmev_proc_admin_sq(new_db, nvmev_vdev->old_dbs[0]);
-		nvmev_vdev->old_dbs[0] = new_db;
-	}
-	new_db = nvmev_vdev->dbs[1];
-	if (new_db != nvmev_vdev->old_dbs[1]) {
-		nvmev_proc_admin_cq(new_db, nvmev_vdev->old_dbs[1]);
-		nvmev_vdev->old_dbs[1] = new_db;
+	if (dispatcher->id == 0) {
+		new_db = nvmev_vdev->dbs[0];
+		if (new_db != nvmev_vdev->old_dbs[0]) {
+			nvmev_proc_admin_sq(new_db, nvmev_vdev->old_dbs[0]);
+			nvmev_vdev->old_dbs[0] = new_db;
+			busy = true;
+		}
+		new_db = nvmev_vdev->dbs[1];
+		if (new_db != nvmev_vdev->old_dbs[1]) {
+			nvmev_proc_admin_cq(new_db, nvmev_vdev->old_dbs[1]);
+			nvmev_vdev->old_dbs[1] = new_db;
+			busy = true;
+		}
 	}
 
-	// Submission queues
-	for (qid = 1; qid <= nvmev_vdev->nr_sq; qid++) {
-		if (nvmev_vdev->sqes[qid] == NULL)
-			continue;
-		dbs_idx = qid * 2;
-		new_db = nvmev_vdev->dbs[dbs_idx];
-		old_db = nvmev_vdev->old_dbs[dbs_idx];
-		if (new_db != old_db) {
-			nvmev_vdev->old_dbs[dbs_idx] = nvmev_proc_io_sq(qid, new_db, old_db);
-		}
+	/*
+	 * The SQ tail and CQ head doorbells of a qid are adjacent, so a single
+	 * 64-bit compare tells whether the queue pair has something new. Mark
+	 * them in @dirty first, then visit only the marked ones.
+	 */
+	bitmap_zero(dirty, NR_MAX_IO_QUEUE + 1);
+	for_each_set_bit(qid, dispatcher->io_queues, NR_MAX_IO_QUEUE + 1) {
+		if (READ_ONCE(((u64 *)dbs)[qid]) != ((u64 *)nvmev_vdev->old_dbs)[qid])
+			__set_bit(qid, dirty);
 	}
 
-	// Completion queues
-	for (qid = 1; qid <= nvmev_vdev->nr_cq; qid++) {
-		if (nvmev_vdev->cqes[qid] == NULL)
-			continue;
+	for_each_set_bit(qid, dirty, NR_MAX_IO_QUEUE + 1) {
+		// Completion queue
 		dbs_idx = qid * 2 + 1;
-		new_db = nvmev_vdev->dbs[dbs_idx];
+		new_db = READ_ONCE(dbs[dbs_idx]);
 		old_db = nvmev_vdev->old_dbs[dbs_idx];
-		if (new_db != old_db) {
+		if (new_db != old_db && nvmev_vdev->cqes[qid] != NULL) {
 			nvmev_proc_io_cq(qid, new_db, old_db);
 			nvmev_vdev->old_dbs[dbs_idx] = new_db;
+			__update_eventidx(dbs_idx);
+			busy = true;
 		}
 	}
+
+	// Submission queues
+	dispatcher->nsecs_rearm = U64_MAX;
+	if (__arbitrate_sqs(dispatcher, dirty))
+		busy = true;
+
+	return busy;
+}
+
+/*
+ * Wait until the other dispatchers are done with the polling pass they may be
+ * in. Dispatchers look up the queues again in every pass, so a queue
+ * unpublished before the call is no longer referenced by any of them after.
+ */
+void nvmev_quiesce_dispatchers(void)
+{
+	unsigned int i;
+
+	smp_mb(); /* Pairs with smp_store_release() in nvmev_dispatcher() */
+
+	for (i = 1; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+		unsigned long nr_passes = READ_ONCE(dispatcher->nr_passes);
+
+		/* A parked dispatcher looks at the doorbells every @idle_max_latency_us */
+		while (READ_ONCE(dispatcher->nr_passes) == nr_passes)
+			cond_resched();
+	}
 }
 
 static int nvmev_dispatcher(void *data)
 {
-	NVMEV_INFO("nvmev_dispatcher started on cpu %d (node %d)\n",
-		   nvmev_vdev->config.cpu_nr_dispatcher,
-		   cpu_to_node(nvmev_vdev->config.cpu_nr_dispatcher));
+	struct nvmev_dispatcher *dispatcher = (struct nvmev_dispatcher *)data;
+	unsigned long long nsecs_last_busy = nvmev_get_host_clock();
+	bool busy;
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", dispatcher->thread_name, smp_processor_id(),
+		   cpu_to_node(smp_processor_id()));
 
 	while (!kthread_should_stop()) {
-		nvmev_proc_bars();
-		nvmev_proc_dbs();
+		if (dispatcher->id == 0)
+			nvmev_proc_bars();
+
+		/*
+		 * Poll while busy. Once idle for @idle_poll_us, check the doorbells
+		 * every @idle_max_latency_us instead of spinning.
+		 */
+		busy = nvmev_proc_dbs(dispatcher);
+
+		/* Done with the queues looked up in this pass */
+		smp_store_release(&dispatcher->nr_passes, dispatcher->nr_passes + 1);
+
+		if (busy) {
+			nsecs_last_busy = nvmev_get_host_clock();
+		} else if (nvmev_vdev->config.idle_poll_us &&
+			   nvmev_get_host_clock() - nsecs_last_busy >= nvmev_vdev->config.idle_poll_us * 1000ULL) {
+			unsigned long long nsecs_sleep = nvmev_vdev->config.idle_max_latency_us * 1000ULL;
+			unsigned long long nsecs = nvmev_get_clock();
+			ktime_t timeout;
+
+			/* Come back by the time a stalled SQ can go on */
+			if (dispatcher->nsecs_rearm != U64_MAX)
+				nsecs_sleep = min(nsecs_sleep,
+						  nvmev_clock_to_host(dispatcher->nsecs_rearm > nsecs ?
+								      dispatcher->nsecs_rearm - nsecs : 0));
+
+			timeout = ns_to_ktime(nsecs_sleep);
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout_range(&timeout, 0, HRTIMER_MODE_REL);
+		}
 
 		cond_resched();
 	}
@@ -174,18 +385,47 @@ static int nvmev_dispatcher(void *data)
 
 static void NVMEV_DISPATCHER_INIT(struct nvmev_dev *nvmev_vdev)
 {
-	nvmev_vdev->nvmev_dispatcher = kthread_create(nvmev_dispatcher, NULL, "nvmev_dispatcher");
-	if (nvmev_vdev->config.cpu_nr_dispatcher != -1)
-		kthread_bind(nvmev_vdev->nvmev_dispatcher, nvmev_vdev->config.cpu_nr_dispatcher);
-	wake_up_process(nvmev_vdev->nvmev_dispatcher);
+	unsigned int i;
+
+	nvmev_vdev->dispatchers = kcalloc(sizeof(struct nvmev_dispatcher),
+					  nvmev_vdev->config.nr_dispatchers, GFP_KERNEL);
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+		unsigned int cpu_nr = nvmev_vdev->config.cpu_nr_dispatchers[i];
+
+		dispatcher->id = i;
+		dispatcher->io_worker_turn = 0;
+		bitmap_zero(dispatcher->io_queues, NR_MAX_IO_QUEUE + 1);
+		snprintf(dispatcher->thread_name, sizeof(dispatcher->thread_name),
+			 "nvmev_dispatcher_%d", i);
+
+		dispatcher->task_struct =
+			kthread_create(nvmev_dispatcher, dispatcher, "%s", dispatcher->thread_name);
+		if (cpu_nr != -1)
+			kthread_bind(dispatcher->task_struct, cpu_nr);
+		wake_up_process(dispatcher->task_struct);
+	}
 }
 
 static void NVMEV_DISPATCHER_FINAL(struct nvmev_dev *nvmev_vdev)
 {
-	if (!IS_ERR_OR_NULL(nvmev_vdev->nvmev_dispatcher)) {
-		kthread_stop(nvmev_vdev->nvmev_dispatcher);
-		nvmev_vdev->nvmev_dispatcher = NULL;
+	unsigned int i;
+
+	if (!nvmev_vdev->dispatchers)
+		return;
+
+	for (i = 0; i < nvmev_vdev->config.nr_dispatchers; i++) {
+		struct nvmev_dispatcher *dispatcher = &nvmev_vdev->dispatchers[i];
+
+		if (!IS_ERR_OR_NULL(dispatcher->task_struct)) {
+			kthread_stop(dispatcher->task_struct);
+			dispatcher->task_struct = NULL;
+		}
 	}
+
+	kfree(nvmev_vdev->dispatchers);
+	nvmev_vdev->dispatchers = NULL;
 }
 
 #ifdef CONFIG_X86
@@ -279,13 +519,165 @@ static void __print_perf_configs(void)
 
 static int __get_nr_entries(int dbs_idx, int queue_size)
 {
-	int diff = nvmev_vdev->dbs[dbs_idx] - nvmev_vdev->old_dbs[dbs_idx];
+	int diff = nvmev_io_dbs()[dbs_idx] - nvmev_vdev->old_dbs[dbs_idx];
 	if (diff < 0) {
 		diff += queue_size;
 	}
 	return diff;
 }
 
+static void __print_qos(struct seq_file *m, const char *type, int id, struct nvmev_qos *qos)
+{
+	if (!qos->iops[NVMEV_QOS_READ].rate && !qos->iops[NVMEV_QOS_WRITE].rate &&
+	    !qos->bw[NVMEV_QOS_READ].rate && !qos->bw[NVMEV_QOS_WRITE].rate)
+		return;
+
+	seq_printf(m, "%s %d: %llu %llu %llu %llu\n", type, id, qos->iops[NVMEV_QOS_READ].rate,
+		   qos->iops[NVMEV_QOS_WRITE].rate, BYTE_TO_MB(qos->bw[NVMEV_QOS_READ].rate),
+		   BYTE_TO_MB(qos->bw[NVMEV_QOS_WRITE].rate));
+}
+
+static void __set_qos_limit(struct nvmev_qos_limit *limit, unsigned long long rate)
+{
+	limit->nsecs_tat = 0;
+	WRITE_ONCE(limit->rate, rate);
+}
+
+/*
+ * "sq <qid> <read IOPS> <write IOPS> <read MiB/s> <write MiB/s>", or the same
+ * with "ns <nsid>". 0 removes the limit.
+ */
+static void __write_qos(const char *input)
+{
+	char type[4];
+	int id;
+	unsigned long long riops, wiops, rbw, wbw;
+	struct nvmev_qos *qos;
+	spinlock_t *lock;
+
+	if (sscanf(input, "%3s %d %llu %llu %llu %llu", type, &id, &riops, &wiops, &rbw, &wbw) != 6)
+		return;
+
+	if (!strcmp(type, "sq") && id >= 1 && id <= NR_MAX_IO_QUEUE) {
+		qos = &nvmev_vdev->sq_qos[id];
+		lock = &nvmev_vdev->sq_qos_lock[id];
+	} else if (!strcmp(type, "ns") && id >= 1 && id <= nvmev_vdev->nr_ns) {
+		qos = &nvmev_vdev->ns[id - 1].qos;
+		lock = &nvmev_vdev->ns[id - 1].qos_lock;
+	} else {
+		NVMEV_ERROR("Invalid QoS target %s %d\n", type, id);
+		return;
+	}
+
+	spin_lock(lock);
+	__set_qos_limit(&qos->iops[NVMEV_QOS_READ], riops);
+	__set_qos_limit(&qos->iops[NVMEV_QOS_WRITE], wiops);
+	__set_qos_limit(&qos->bw[NVMEV_QOS_READ], MB(rbw));
+	__set_qos_limit(&qos->bw[NVMEV_QOS_WRITE], MB(wbw));
+	spin_unlock(lock);
+
+	NVMEV_INFO("QoS %s %d: %llu/%llu IOPS, %llu/%llu MiB/s\n", type, id, riops, wiops, rbw, wbw);
+}
+
+static const char *lat_stage_names[NR_NVMEV_LAT_STAGES] = {
+	"enqueue", "copy_start", "copy_done", "cq_filled", "lateness",
+};
+
+static const char *lat_op_names[NR_NVMEV_LAT_OPS] = {
+	"read", "write", "flush", "other",
+};
+
+/* Sum up histogram @idx of the io workers that have caught up with the last reset */
+static void __sum_lat_hist(struct nvmev_lat_hist *sum, unsigned int idx)
+{
+	unsigned int reset_gen = READ_ONCE(nvmev_vdev->lat_reset_gen);
+	unsigned int i, b;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i = 0; i < nvmev_vdev->config.nr_io_workers; i++) {
+		struct nvmev_lat_stat *lat = nvmev_vdev->io_workers[i].lat;
+		struct nvmev_lat_hist *hist;
+
+		if (!lat || READ_ONCE(lat->reset_gen) != reset_gen)
+			continue;
+		hist = &lat->hist[idx];
+		smp_rmb();
+
+		sum->nr += hist->nr;
+		sum->sum += hist->sum;
+		sum->max = max(sum->max, hist->max);
+		for (b = 0; b < NR_LAT_BUCKETS; b++)
+			sum->buckets[b] += hist->buckets[b];
+	}
+}
+
+/* Upper bound of the latency under which @ratio / 10000 of the samples are */
+static unsigned long long __lat_percentile(struct nvmev_lat_hist *hist, unsigned int ratio)
+{
+	unsigned long long rank = div_u64(hist->nr * ratio + 9999, 10000);
+	unsigned long long nr = 0;
+	unsigned int b;
+
+	for (b = 0; b < NR_LAT_BUCKETS - 1; b++) {
+		nr += hist->buckets[b];
+		if (nr >= rank)
+			return min(nvmev_lat_bucket_nsecs(b + 1) - 1, hist->max);
+	}
+
+	return hist->max;
+}
+
+static void __print_lat_hist(struct seq_file *m, const char *name, int id,
+			     struct nvmev_lat_hist *hist)
+{
+	if (id >= 0)
+		seq_printf(m, "%s %d:", name, id);
+	else
+		seq_printf(m, "%s:", name);
+
+	seq_printf(m, " %llu %llu %llu %llu %llu %llu %llu\n", hist->nr,
+		   hist->nr ? div64_u64(hist->sum, hist->nr) : 0, __lat_percentile(hist, 5000),
+		   __lat_percentile(hist, 9000), __lat_percentile(hist, 9900),
+		   __lat_percentile(hist, 9990), hist->max);
+}
+
+/*
+ * count, mean, p50, p90, p99, p99.9 and max in ns for each stage since the
+ * submission, and for the cq fill latency per opcode class and per sq.
+ */
+static void __print_latency(struct seq_file *m)
+{
+	struct nvmev_lat_hist *hist;
+	int i;
+
+	if (!nvmev_vdev->io_workers)
+		return;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return;
+
+	for (i = 0; i < NR_NVMEV_LAT_STAGES; i++) {
+		__sum_lat_hist(hist, LAT_HIST_STAGE(i));
+		__print_lat_hist(m, lat_stage_names[i], -1, hist);
+	}
+
+	for (i = 0; i < NR_NVMEV_LAT_OPS; i++) {
+		__sum_lat_hist(hist, LAT_HIST_OP(i));
+		if (hist->nr)
+			__print_lat_hist(m, lat_op_names[i], -1, hist);
+	}
+
+	for (i = 1; i <= NR_MAX_IO_QUEUE; i++) {
+		__sum_lat_hist(hist, LAT_HIST_SQ(i));
+		if (hist->nr)
+			__print_lat_hist(m, "sq", i, hist);
+	}
+
+	kfree(hist);
+}
+
 static int __proc_file_read(struct seq_file *m, void *data)
 {
 	const char *filename = m->private;
@@ -327,6 +719,18 @@ static int __proc_file_read(struct seq_file *m, void *data)
 			   total_io);
 	} else if (strcmp(filename, "debug") == 0) {
 		/* Left for later use */
+	} else if (strcmp(filename, "clock") == 0) {
+		seq_printf(m, "device %llu host %llu scale %u skipped %lld\n", nvmev_get_clock(),
+			   nvmev_get_host_clock(), nvmev_clock.scale,
+			   atomic64_read(&nvmev_clock.nsecs_skipped));
+	} else if (strcmp(filename, "qos") == 0) {
+		int i;
+		for (i = 1; i <= NR_MAX_IO_QUEUE; i++)
+			__print_qos(m, "sq", i, &nvmev_vdev->sq_qos[i]);
+		for (i = 0; i < nvmev_vdev->nr_ns; i++)
+			__print_qos(m, "ns", i + 1, &nvmev_vdev->ns[i].qos);
+	} else if (strcmp(filename, "latency") == 0) {
+		__print_latency(m);
 	}
 
 	return 0;
@@ -343,7 +747,10 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 	struct nvmev_config *cfg = &nvmev_vdev->config;
 	size_t nr_copied;
 
-	nr_copied = copy_from_user(input, buf, min(len, sizeof(input)));
+	/* Leave room for the NUL that sscanf() relies on */
+	len = min(len, sizeof(input) - 1);
+	nr_copied = copy_from_user(input, buf, len);
+	input[len - nr_copied] = '\0';
 
 	if (!strcmp(filename, "read_times")) {
 		ret = sscanf(input, "%u %u %u", &cfg->read_delay, &cfg->read_time,
@@ -377,6 +784,11 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 		}
 	} else if (!strcmp(filename, "debug")) {
 		/* Left for later use */
+	} else if (!strcmp(filename, "qos")) {
+		__write_qos(input);
+	} else if (!strcmp(filename, "latency")) {
+		/* The io workers clear their own histograms */
+		WRITE_ONCE(nvmev_vdev->lat_reset_gen, nvmev_vdev->lat_reset_gen + 1);
 	}
 
 out:
@@ -433,6 +845,10 @@ static void NVMEV_STORAGE_INIT(struct nvmev_dev *nvmev_vdev)
 		proc_create("io_units", 0664, nvmev_vdev->proc_root, &proc_file_fops);
 	nvmev_vdev->proc_stat = proc_create("stat", 0444, nvmev_vdev->proc_root, &proc_file_fops);
 	nvmev_vdev->proc_debug = proc_create("debug", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_qos = proc_create("qos", 0664, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_clock = proc_create("clock", 0444, nvmev_vdev->proc_root, &proc_file_fops);
+	nvmev_vdev->proc_latency =
+		proc_create("latency", 0664, nvmev_vdev->proc_root, &proc_file_fops);
 }
 
 static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -442,6 +858,9 @@ static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
 	remove_proc_entry("io_units", nvmev_vdev->proc_root);
 	remove_proc_entry("stat", nvmev_vdev->proc_root);
 	remove_proc_entry("debug", nvmev_vdev->proc_root);
+	remove_proc_entry("qos", nvmev_vdev->proc_root);
+	remove_proc_entry("clock", nvmev_vdev->proc_root);
+	remove_proc_entry("latency", nvmev_vdev->proc_root);
 
 	remove_proc_entry("nvmev", NULL);
 
@@ -452,11 +871,37 @@ static void NVMEV_STORAGE_FINAL(struct nvmev_dev *nvmev_vdev)
 		kfree(nvmev_vdev->io_unit_stat);
 }
 
+/* Returns the number of CPUs in @list, 0 if it is empty, or -EINVAL */
+static int __parse_cpu_list(char *list, unsigned int *cpu_nrs, unsigned int max)
+{
+	unsigned int nr = 0;
+	unsigned int cpu_nr;
+	char *cpu;
+
+	if (!*list)
+		return 0;
+
+	while ((cpu = strsep(&list, ",")) != NULL) {
+		if (kstrtouint(cpu, 10, &cpu_nr)) {
+			NVMEV_ERROR("Invalid CPU '%s' in cpus\n", cpu);
+			return -EINVAL;
+		}
+		if (nr == max) {
+			NVMEV_ERROR("Too many CPUs are given, ignoring %s\n", cpu);
+			continue;
+		}
+		cpu_nrs[nr++] = cpu_nr;
+	}
+
+	return nr;
+}
+
 static bool __load_configs(struct nvmev_config *config)
 {
 	bool first = true;
 	unsigned int cpu_nr;
 	char *cpu;
+	int nr;
 
 	if (__validate_configs() < 0) {
 		return false;
@@ -480,30 +925,92 @@ static bool __load_configs(struct nvmev_config *config)
 	config->write_trailing = write_trailing;
 	config->nr_io_units = nr_io_units;
 	config->io_unit_shift = io_unit_shift;
+	config->idle_poll_us = idle_poll_us;
+	config->idle_max_latency_us = idle_max_latency_us;
 
 	config->nr_io_workers = 0;
-	config->cpu_nr_dispatcher = -1;
-
-	while ((cpu = strsep(&cpus, ",")) != NULL) {
-		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
-		if (first) {
-			config->cpu_nr_dispatcher = cpu_nr;
-		} else {
-			config->cpu_nr_io_workers[config->nr_io_workers] = cpu_nr;
-			config->nr_io_workers++;
+	config->nr_copiers = 0;
+	config->nr_dispatchers = 1;
+	config->cpu_nr_dispatchers[0] = -1;
+
+	if (cpus && strchr(cpus, ':')) {
+		/* <dispatcher cpus>:<io worker cpus>[:<copier cpus>] */
+		char *dispatchers = strsep(&cpus, ":");
+		char *io_workers = strsep(&cpus, ":");
+
+		nr = __parse_cpu_list(dispatchers, config->cpu_nr_dispatchers,
+				      ARRAY_SIZE(config->cpu_nr_dispatchers));
+		if (nr < 0)
+			return false;
+		config->nr_dispatchers = nr;
+
+		nr = __parse_cpu_list(io_workers, config->cpu_nr_io_workers,
+				      ARRAY_SIZE(config->cpu_nr_io_workers));
+		if (nr < 0)
+			return false;
+		config->nr_io_workers = nr;
+
+		/* No copiers for an empty or missing third list, e.g., cpus=7:8,9: */
+		if (cpus) {
+			nr = __parse_cpu_list(cpus, config->cpu_nr_copiers,
+					      ARRAY_SIZE(config->cpu_nr_copiers));
+			if (nr < 0)
+				return false;
+			config->nr_copiers = nr;
 		}
-		first = false;
+	} else {
+		/* The first cpu for the dispatcher, and the rest for io workers */
+		while ((cpu = strsep(&cpus, ",")) != NULL) {
+			if (kstrtouint(cpu, 10, &cpu_nr)) {
+				NVMEV_ERROR("Invalid CPU '%s' in cpus\n", cpu);
+				return false;
+			}
+			if (first) {
+				config->cpu_nr_dispatchers[0] = cpu_nr;
+			} else if (config->nr_io_workers < ARRAY_SIZE(config->cpu_nr_io_workers)) {
+				config->cpu_nr_io_workers[config->nr_io_workers] = cpu_nr;
+				config->nr_io_workers++;
+			}
+			first = false;
+		}
+	}
+
+	if (config->nr_dispatchers == 0 || config->nr_io_workers < config->nr_dispatchers) {
+		NVMEV_ERROR("Need at least one dispatcher and one io worker per dispatcher\n");
+		return false;
 	}
 
 	return true;
 }
 
+/* The largest MDTS, in the power of 2 of the 4 KiB minimum memory page size */
+static unsigned int __max_mdts(void)
+{
+	size_t max_size = LBA_TO_BYTE(1UL << 16); /* NLB is a 16-bit field */
+	unsigned int max_mdts = 0;
+
+#ifdef GLOBAL_WB_SIZE
+	/* A write has to fit in the write buffer at once */
+	size_t wb_size = GLOBAL_WB_SIZE;
+#ifdef ZONE_WB_SIZE
+	if (ZONE_WB_SIZE)
+		wb_size = ZONE_WB_SIZE;
+#endif
+	if (wb_size)
+		max_size = min_t(size_t, max_size, wb_size);
+#endif
+
+	while ((PAGE_SIZE << (max_mdts + 1)) <= max_size)
+		max_mdts++;
+
+	return max_mdts;
+}
+
 static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 {
 	unsigned long long remaining_capacity = nvmev_vdev->config.storage_size;
 	void *ns_addr = nvmev_vdev->storage_mapped;
 	const int nr_ns = NR_NAMESPACES; // XXX: allow for dynamic nr_ns
-	const unsigned int disp_no = nvmev_vdev->config.cpu_nr_dispatcher;
 	int i;
 	unsigned long long size;
 
@@ -516,16 +1023,20 @@ static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 			size = min(NS_CAPACITY(i), remaining_capacity);
 
 		if (NS_SSD_TYPE(i) == SSD_TYPE_NVM)
-			simple_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			simple_init_namespace(&ns[i], i, size, ns_addr);
 		else if (NS_SSD_TYPE(i) == SSD_TYPE_CONV)
-			conv_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			conv_init_namespace(&ns[i], i, size, ns_addr);
 		else if (NS_SSD_TYPE(i) == SSD_TYPE_ZNS)
-			zns_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			zns_init_namespace(&ns[i], i, size, ns_addr);
 		else if (NS_SSD_TYPE(i) == SSD_TYPE_KV)
-			kv_init_namespace(&ns[i], i, size, ns_addr, disp_no);
+			kv_init_namespace(&ns[i], i, size, ns_addr);
 		else
 			BUG_ON(1);
 
+		spin_lock_init(&ns[i].lock);
+		spin_lock_init(&ns[i].qos_lock);
+		memset(&ns[i].qos, 0x00, sizeof(ns[i].qos));
+
 		remaining_capacity -= size;
 		ns_addr += size;
 		NVMEV_INFO("ns %d/%d: size %lld MiB\n", i, nr_ns, BYTE_TO_MB(ns[i].size));
@@ -533,7 +1044,11 @@ static void NVMEV_NAMESPACE_INIT(struct nvmev_dev *nvmev_vdev)
 
 	nvmev_vdev->ns = ns;
 	nvmev_vdev->nr_ns = nr_ns;
-	nvmev_vdev->mdts = MDTS;
+	nvmev_vdev->mdts = mdts ? mdts : MDTS;
+	if (nvmev_vdev->mdts > __max_mdts()) {
+		NVMEV_ERROR("mdts %u is too large, using %u\n", nvmev_vdev->mdts, __max_mdts());
+		nvmev_vdev->mdts = __max_mdts();
+	}
 }
 
 static void NVMEV_NAMESPACE_FINAL(struct nvmev_dev *nvmev_vdev)
@@ -584,12 +1099,41 @@ static void __print_base_config(void)
 			(NVMEV_VERSION & 0xff00) >> 8, (NVMEV_VERSION & 0x00ff), type);
 }
 
+static void NVMEV_CLOCK_INIT(struct nvmev_clock *clock)
+{
+	unsigned long flags;
+
+	clock->use_tsc = boot_cpu_has(X86_FEATURE_CONSTANT_TSC) &&
+			 boot_cpu_has(X86_FEATURE_NONSTOP_TSC) && !check_tsc_unstable() && tsc_khz;
+
+	if (clock->use_tsc) {
+		clocks_calc_mult_shift(&clock->mult, &clock->shift, tsc_khz, NSEC_PER_MSEC, 0);
+
+		local_irq_save(flags);
+		clock->tsc_base = rdtsc();
+		clock->nsecs_base = ktime_get_mono_fast_ns();
+		local_irq_restore(flags);
+	} else {
+		clock->nsecs_base = ktime_get_mono_fast_ns();
+	}
+
+	clock->scale = max(time_scale, 1U);
+	clock->skip_idle = time_skip;
+	atomic64_set(&clock->nsecs_skipped, 0);
+	atomic_set(&clock->nr_unsettled, 0);
+
+	NVMEV_INFO("Clock source: %s, x%u%s\n", clock->use_tsc ? "tsc" : "monotonic", clock->scale,
+		   clock->skip_idle ? ", skipping idle time" : "");
+}
+
 static int NVMeV_init(void)
 {
 	int ret = 0;
 
 	__print_base_config();
 
+	NVMEV_CLOCK_INIT(&nvmev_clock);
+
 	nvmev_vdev = VDEV_INIT();
 	if (!nvmev_vdev)
 		return -EINVAL;
@@ -600,10 +1144,17 @@ static int NVMeV_init(void)
 
 	NVMEV_STORAGE_INIT(nvmev_vdev);
 
+	/* Benchmarks on the storage area before anything is stored there */
+	nvmev_copy_init(copy_read, copy_write, nvmev_vdev->storage_mapped,
+			nvmev_vdev->config.storage_size, MB((size_t)copy_bench_mb));
+
 	NVMEV_NAMESPACE_INIT(nvmev_vdev);
 
-	if (io_using_dma) {
-		if (ioat_dma_chan_set("dma7chan0") != 0) {
+	if (dma_channels) {
+		io_using_dma = true;
+		if (ioat_dma_chans_set(dma_channels) != 0) {
+			/* Release the channels requested before the failing one */
+			ioat_dma_cleanup();
 			io_using_dma = false;
 			NVMEV_ERROR("Cannot use DMA engine, Fall back to memcpy\n");
 		}
@@ -144,6 +144,7 @@ enum {
 	NVME_CTRL_ONCS_WRITE_UNCORRECTABLE = 1 << 1,
 	NVME_CTRL_ONCS_DSM = 1 << 2,
 	NVME_CTRL_VWC_PRESENT = 1 << 0,
+	NVME_CTRL_OACS_DBBUF_SUPP = 1 << 8,
 };
 
 struct nvme_lbaf {
@@ -344,6 +345,33 @@ static const char *const __nvme_opcode_strings[] = {
 #define nvme_opcode_string(opcode) \
 	(__nvme_opcode_strings[opcode] ? __nvme_opcode_strings[opcode] : "unknown")
 
+/* Data pointer type in the command flags (PSDT) */
+enum {
+	NVME_CMD_SGL_METABUF = (1 << 6),
+	NVME_CMD_SGL_METASEG = (1 << 7),
+	NVME_CMD_SGL_ALL = NVME_CMD_SGL_METABUF | NVME_CMD_SGL_METASEG,
+};
+
+/* SGL descriptor type in the upper 4 bits of @type, sub type in the lower 4 bits */
+enum {
+	NVME_SGL_FMT_DATA_DESC = 0x00,
+	NVME_SGL_FMT_BIT_BUCKET_DESC = 0x01,
+	NVME_SGL_FMT_SEG_DESC = 0x02,
+	NVME_SGL_FMT_LAST_SEG_DESC = 0x03,
+};
+
+enum {
+	NVME_SGL_FMT_ADDRESS = 0x00,
+	NVME_SGL_FMT_OFFSET = 0x01,
+};
+
+struct nvme_sgl_desc {
+	__le64 addr;
+	__le32 length;
+	__u8 rsvd[3];
+	__u8 type;
+};
+
 struct nvme_common_command {
 	__u8 opcode;
 	__u8 flags;
@@ -584,6 +612,16 @@ struct nvme_delete_queue {
 	__u32 rsvd11[5];
 };
 
+struct nvme_dbbuf {
+	__u8 opcode;
+	__u8 flags;
+	__u16 command_id;
+	__u32 rsvd1[5];
+	__le64 prp1;
+	__le64 prp2;
+	__u32 rsvd12[6];
+};
+
 struct nvme_abort_cmd {
 	__u8 opcode;
 	__u8 flags;
@@ -630,6 +668,7 @@ struct nvme_command {
 		struct nvme_format_cmd format;
 		struct nvme_dsm_cmd dsm;
 		struct nvme_abort_cmd abort;
+		struct nvme_dbbuf dbbuf;
 	};
 };
 
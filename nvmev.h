@@ -5,7 +5,11 @@
 
 #include <linux/pci.h>
 #include <linux/msi.h>
+#include <linux/rbtree.h>
+#include <linux/math64.h>
+#include <linux/timekeeping.h>
 #include <asm/apic.h>
+#include <asm/tsc.h>
 
 #include "nvme.h"
 
@@ -44,6 +48,11 @@
 #define NR_MAX_IO_QUEUE 72
 #define NR_MAX_PARALLEL_IO 16384
 
+/* Work entries of an io worker are allocated in chunks on demand */
+#define IO_WORK_CHUNK_SHIFT 8
+#define IO_WORK_CHUNK_SIZE (1 << IO_WORK_CHUNK_SHIFT)
+#define NR_IO_WORK_CHUNKS (NR_MAX_PARALLEL_IO >> IO_WORK_CHUNK_SHIFT)
+
 #define NVMEV_INTX_IRQ 15
 
 #define PAGE_OFFSET_MASK (PAGE_SIZE - 1)
@@ -70,6 +79,8 @@
 
 #include "ssd_config.h"
 
+struct buffer;
+
 struct nvmev_sq_stat {
 	unsigned int nr_dispatched;
 	unsigned int nr_dispatch;
@@ -78,14 +89,52 @@ struct nvmev_sq_stat {
 	unsigned long long total_io;
 };
 
+/* Submission queue priority classes for weighted round robin arbitration */
+enum {
+	NVMEV_SQ_PRIO_URGENT = 0,
+	NVMEV_SQ_PRIO_HIGH,
+	NVMEV_SQ_PRIO_MEDIUM,
+	NVMEV_SQ_PRIO_LOW,
+	NR_NVMEV_SQ_PRIO,
+};
+
+#define NVMEV_ARB_BURST_NO_LIMIT 7
+
+/*
+ * QoS limits, enforced as token buckets. A limit is tracked with the time its
+ * bucket runs dry (theoretical arrival time), and lets a burst of
+ * NVMEV_QOS_BURST_NS worth of tokens through.
+ */
+enum {
+	NVMEV_QOS_READ = 0,
+	NVMEV_QOS_WRITE,
+	NR_NVMEV_QOS_DIR,
+};
+
+#define NVMEV_QOS_BURST_NS (1000 * 1000)
+
+struct nvmev_qos_limit {
+	unsigned long long rate; /* per second, 0 for no limit */
+	unsigned long long nsecs_tat;
+};
+
+struct nvmev_qos {
+	struct nvmev_qos_limit iops[NR_NVMEV_QOS_DIR];
+	struct nvmev_qos_limit bw[NR_NVMEV_QOS_DIR]; /* in bytes */
+};
+
 struct nvmev_submission_queue {
 	int qid;
 	int cqid;
-	int priority;
+	int priority; /* NVMEV_SQ_PRIO_* */
 	bool phys_contig;
 
 	int queue_size;
 
+	/* The head command waits for @stall_size bytes in @stall_buffer */
+	struct buffer *stall_buffer;
+	size_t stall_size;
+
 	struct nvmev_sq_stat stat;
 
 	struct nvme_command __iomem **sq;
@@ -107,6 +156,10 @@ struct nvmev_completion_queue {
 	int cq_head;
 	int cq_tail;
 
+	/* Interrupt coalescing */
+	unsigned int nr_coalesced; /* completions posted since the last interrupt */
+	unsigned long long nsecs_coalesce_start; /* when the first of them was posted */
+
 	struct nvme_completion __iomem **cq;
 };
 
@@ -138,14 +191,20 @@ struct nvmev_config {
 	unsigned long storage_start; //byte
 	unsigned long storage_size; // byte
 
-	unsigned int cpu_nr_dispatcher;
+	unsigned int nr_dispatchers;
+	unsigned int cpu_nr_dispatchers[32];
 	unsigned int nr_io_workers;
 	unsigned int cpu_nr_io_workers[32];
+	unsigned int nr_copiers; // 0 to let io workers copy data by themselves
+	unsigned int cpu_nr_copiers[32];
 
 	/* TODO Refactoring storage configurations */
 	unsigned int nr_io_units;
 	unsigned int io_unit_shift; // 2^
 
+	unsigned int idle_poll_us; // keep polling this long after the last work, 0 to always poll
+	unsigned int idle_max_latency_us; // upper bound of the wake-up latency of idle dispatchers
+
 	unsigned int read_delay; // ns
 	unsigned int read_time; // ns
 	unsigned int read_trailing; // ns
@@ -155,11 +214,14 @@ struct nvmev_config {
 };
 
 struct nvmev_io_work {
+	unsigned int id; /* index in the work pool */
+
 	int sqid;
 	int cqid;
 
 	int sq_entry;
 	unsigned int command_id;
+	unsigned int opcode;
 
 	unsigned long long nsecs_start;
 	unsigned long long nsecs_target;
@@ -170,30 +232,158 @@ struct nvmev_io_work {
 	unsigned long long nsecs_cq_filled;
 
 	bool is_copied;
-	bool is_completed;
+	atomic_t nr_dma_pending; /* DMA copies in flight, plus one while queueing them */
+	struct nvmev_io_worker *worker; /* to wake up when the DMA copies are done */
+	size_t dma_queued; /* bytes handed to the DMA engine so far */
+	unsigned long long nsecs_dma_stalled; /* host clock when DMA descriptors ran out */
+	atomic_t settle_refs; /* copy and io_tree insertion left, with skip_idle */
 
 	unsigned int status;
 	unsigned int result0;
 	unsigned int result1;
 
-	bool is_internal;
-	void *write_buffer;
-	size_t buffs_to_release;
+	unsigned int next; /* in copy_seq, stolen_seq or dma_stalled_seq */
+	struct rb_node node; /* in io_tree, keyed on nsecs_target */
+};
+
+/*
+ * Log-linear latency histogram. Each power of 2 of nanoseconds is split into
+ * NR_LAT_SUB_BUCKETS linear buckets, so a bucket stays within 1/4 of the
+ * latencies it counts. Latencies of 2^LAT_MAX_SHIFT ns or more go to the last
+ * bucket.
+ */
+#define LAT_SUB_SHIFT 2
+#define NR_LAT_SUB_BUCKETS (1 << LAT_SUB_SHIFT)
+#define LAT_MAX_SHIFT 36
+#define NR_LAT_BUCKETS ((LAT_MAX_SHIFT - LAT_SUB_SHIFT + 1) << LAT_SUB_SHIFT)
+
+struct nvmev_lat_hist {
+	unsigned long long nr;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[NR_LAT_BUCKETS];
+};
+
+/* Stages of an io req, measured from its nsecs_start */
+enum {
+	NVMEV_LAT_ENQUEUE = 0,
+	NVMEV_LAT_COPY_START,
+	NVMEV_LAT_COPY_DONE,
+	NVMEV_LAT_CQ_FILLED,
+	NVMEV_LAT_LATENESS, /* from nsecs_target to the cq fill */
+	NR_NVMEV_LAT_STAGES,
+};
+
+enum {
+	NVMEV_LAT_OP_READ = 0,
+	NVMEV_LAT_OP_WRITE,
+	NVMEV_LAT_OP_FLUSH,
+	NVMEV_LAT_OP_OTHER,
+	NR_NVMEV_LAT_OPS,
+};
+
+/* Per opcode class and per sq histograms are on the cq fill latency */
+#define LAT_HIST_STAGE(stage) (stage)
+#define LAT_HIST_OP(op) (NR_NVMEV_LAT_STAGES + (op))
+#define LAT_HIST_SQ(qid) (NR_NVMEV_LAT_STAGES + NR_NVMEV_LAT_OPS + (qid))
+#define NR_LAT_HISTS LAT_HIST_SQ(NR_MAX_IO_QUEUE + 1)
+
+/*
+ * Written by its io worker only. Readers skip the histograms until the io
+ * worker has caught up with a reset, see nvmev_dev.lat_reset_gen.
+ */
+struct nvmev_lat_stat {
+	unsigned int reset_gen;
+	struct nvmev_lat_hist hist[NR_LAT_HISTS];
+};
 
-	unsigned int next, prev;
+static inline unsigned int nvmev_lat_bucket(unsigned long long nsecs)
+{
+	unsigned int shift;
+
+	if (nsecs < NR_LAT_SUB_BUCKETS)
+		return nsecs;
+	if (nsecs >> LAT_MAX_SHIFT)
+		return NR_LAT_BUCKETS - 1;
+
+	shift = fls64(nsecs) - 1 - LAT_SUB_SHIFT;
+	return ((shift + 1) << LAT_SUB_SHIFT) + ((nsecs >> shift) & (NR_LAT_SUB_BUCKETS - 1));
+}
+
+/* The smallest latency counted in @bucket */
+static inline unsigned long long nvmev_lat_bucket_nsecs(unsigned int bucket)
+{
+	unsigned int group = bucket >> LAT_SUB_SHIFT;
+
+	if (group == 0)
+		return bucket;
+
+	return (unsigned long long)(NR_LAT_SUB_BUCKETS + (bucket & (NR_LAT_SUB_BUCKETS - 1)))
+	       << (group - 1);
+}
+
+/*
+ * Single-producer/single-consumer ring of work entry indexes. The producer
+ * only writes @head and the consumer only writes @tail, so each side keeps
+ * its index on its own cacheline.
+ */
+struct nvmev_io_ring {
+	unsigned int *entries;
+	unsigned int size; /* power of 2 */
+
+	unsigned int head ____cacheline_aligned; /* next index to produce */
+	unsigned int tail ____cacheline_aligned; /* next index to consume */
+	unsigned int head_cache; /* consumer's last snapshot of @head */
 };
 
 struct nvmev_io_worker {
-	struct nvmev_io_work *work_queue;
+	struct nvmev_io_work *work_chunks[NR_IO_WORK_CHUNKS];
+	unsigned int nr_works; /* entries in @work_chunks */
+	unsigned int next_fresh; /* entries from here on have never been used */
+	unsigned int spare_entry; /* reserved for a request left in its SQ, or -1 */
+
+	struct nvmev_io_ring submission; /* dispatcher -> io worker */
+	struct nvmev_io_ring reclaim; /* io worker -> dispatcher, free entries */
+
+	/* Shared with the io workers stealing copies, under @copy_lock */
+	spinlock_t copy_lock ____cacheline_aligned;
+	unsigned int copy_seq; /* copy pending io req head index */
+	unsigned int copy_seq_end; /* copy pending io req tail index */
+	unsigned int stolen_seq; /* io reqs copied by other io workers */
+
+	/* Owned by the io worker */
+	struct rb_root_cached io_tree ____cacheline_aligned; /* io reqs waiting for nsecs_target */
+	DECLARE_BITMAP(irq_pending, NR_MAX_IO_QUEUE + 1); /* cqs this worker has filled */
+	unsigned int dma_stalled_seq; /* io reqs waiting for DMA descriptors */
+	unsigned long long nsecs_last_busy; /* on the host clock */
+	bool is_idle; /* parked; the dispatcher shall wake it up on a new request */
+	unsigned long nr_passes; /* loop passes done, see nvmev_quiesce_io_workers() */
+	unsigned long long nsecs_next_due; /* 0 if busy, U64_MAX if nothing to complete */
+	struct nvmev_lat_stat *lat;
 
-	unsigned int free_seq; /* free io req head index */
-	unsigned int free_seq_end; /* free io req tail index */
-	unsigned int io_seq; /* io req head index */
-	unsigned int io_seq_end; /* io req tail index */
+	unsigned int id;
+	struct task_struct *task_struct;
+	char thread_name[32];
+};
 
-	unsigned long long latest_nsecs;
+/* Moves data for the io workers, which then only complete the requests */
+struct nvmev_copier {
+	unsigned int id;
+	unsigned int turn; /* io worker to look at first */
 
+	struct task_struct *task_struct;
+	char thread_name[32];
+};
+
+struct nvmev_dispatcher {
 	unsigned int id;
+	unsigned int io_worker_turn;
+
+	DECLARE_BITMAP(io_queues, NR_MAX_IO_QUEUE + 1); /* qids of live I/O queues */
+	int arb_last_qid[NR_NVMEV_SQ_PRIO]; /* the SQ served last in each class */
+	unsigned long nr_passes; /* doorbell polling passes done, see nvmev_quiesce_dispatchers() */
+	unsigned long long nsecs_rearm; /* when the first SQ stalled on a write buffer may go on */
+
 	struct task_struct *task_struct;
 	char thread_name[32];
 };
@@ -210,12 +400,12 @@ struct nvmev_dev {
 	struct pci_dev *pdev;
 
 	struct nvmev_config config;
-	struct task_struct *nvmev_dispatcher;
+	struct nvmev_dispatcher *dispatchers;
 
 	void *storage_mapped;
 
 	struct nvmev_io_worker *io_workers;
-	unsigned int io_worker_turn;
+	struct nvmev_copier *copiers;
 
 	void __iomem *msix_table;
 
@@ -227,6 +417,10 @@ struct nvmev_dev {
 	u32 *old_dbs;
 	u32 __iomem *dbs;
 
+	/* Shadow doorbells and EventIdx for I/O queues (Doorbell Buffer Config) */
+	u32 *dbbuf_dbs;
+	u32 *dbbuf_eis;
+
 	struct nvmev_ns *ns;
 	unsigned int nr_ns;
 	unsigned int nr_sq;
@@ -236,14 +430,33 @@ struct nvmev_dev {
 	struct nvmev_submission_queue *sqes[NR_MAX_IO_QUEUE + 1];
 	struct nvmev_completion_queue *cqes[NR_MAX_IO_QUEUE + 1];
 
+	/* By qid, kept across the deletion of the queue */
+	struct nvmev_qos sq_qos[NR_MAX_IO_QUEUE + 1]; /* protected by @sq_qos_lock */
+	spinlock_t sq_qos_lock[NR_MAX_IO_QUEUE + 1];
+
 	unsigned int mdts;
 
+	/* Interrupt coalescing (NVME_FEAT_IRQ_COALESCE, NVME_FEAT_IRQ_CONFIG) */
+	unsigned int irq_coalesce_thr; /* 0's based */
+	unsigned int irq_coalesce_time; /* in 100 usec */
+	DECLARE_BITMAP(irq_coalesce_disabled, NR_MAX_IO_QUEUE + 1); /* by irq vector */
+
+	/* Command arbitration (CC.AMS, NVME_FEAT_ARBITRATION) */
+	bool arb_wrr; /* weighted round robin with urgent priority class */
+	unsigned int arb_burst; /* log2 of the arbitration burst */
+	unsigned int arb_weights[NR_NVMEV_SQ_PRIO]; /* 0's based, for high/medium/low */
+
+	unsigned int lat_reset_gen; /* bumped to reset the latency histograms */
+
 	struct proc_dir_entry *proc_root;
 	struct proc_dir_entry *proc_read_times;
 	struct proc_dir_entry *proc_write_times;
 	struct proc_dir_entry *proc_io_units;
 	struct proc_dir_entry *proc_stat;
 	struct proc_dir_entry *proc_debug;
+	struct proc_dir_entry *proc_qos;
+	struct proc_dir_entry *proc_clock;
+	struct proc_dir_entry *proc_latency;
 
 	unsigned long long *io_unit_stat;
 };
@@ -257,6 +470,10 @@ struct nvmev_request {
 struct nvmev_result {
 	uint32_t status;
 	uint64_t nsecs_target;
+
+	/* Set along with returning false when the write buffer is full */
+	struct buffer *wait_buffer;
+	size_t wait_size;
 };
 
 struct nvmev_ns {
@@ -265,6 +482,17 @@ struct nvmev_ns {
 	uint64_t size;
 	void *mapped;
 
+	/*
+	 * Serializes the FTL calls from multiple dispatchers. A command spans
+	 * several partitions of the FTL, which also share the write buffer and
+	 * the PCIe model, so the FTL of a namespace runs on one dispatcher at a
+	 * time.
+	 */
+	spinlock_t lock;
+
+	struct nvmev_qos qos; // protected by @qos_lock
+	spinlock_t qos_lock;
+
 	/*conv ftl or zns or kv*/
 	uint32_t nr_parts; // partitions
 	void *ftls; // ftl instances. one ftl per partition
@@ -283,7 +511,78 @@ struct nvmev_ns {
 // VDEV Init, Final Function
 extern struct nvmev_dev *nvmev_vdev;
 struct nvmev_dev *VDEV_INIT(void);
+
+/*
+ * Time base shared by the dispatchers, the io workers, and the performance
+ * models. With an invariant TSC, it is the TSC scaled to nanoseconds, which
+ * is consistent across cpus and costs a few cycles. Otherwise, it falls back
+ * to the monotonic clock.
+ *
+ * The device runs on a virtual clock derived from it, which advances @scale
+ * times as fast as the host clock, plus the idle time skipped over in the
+ * event-driven mode.
+ */
+struct nvmev_clock {
+	bool use_tsc;
+	u64 tsc_base;
+	u64 nsecs_base;
+	u32 mult;
+	u32 shift;
+
+	unsigned int scale;
+	bool skip_idle;
+	atomic64_t nsecs_skipped;
+	atomic_t nr_unsettled; /* requests not both copied and in an io_tree yet */
+};
+extern struct nvmev_clock nvmev_clock;
+
+static inline unsigned long long nvmev_get_host_clock(void)
+{
+	if (likely(nvmev_clock.use_tsc))
+		return nvmev_clock.nsecs_base + mul_u64_u32_shr(rdtsc() - nvmev_clock.tsc_base,
+								nvmev_clock.mult, nvmev_clock.shift);
+
+	return ktime_get_mono_fast_ns();
+}
+
+static inline unsigned long long nvmev_get_clock(void)
+{
+	unsigned long long nsecs = nvmev_get_host_clock();
+
+	if (unlikely(nvmev_clock.scale > 1))
+		nsecs = nvmev_clock.nsecs_base + (nsecs - nvmev_clock.nsecs_base) * nvmev_clock.scale;
+
+	return nsecs + atomic64_read(&nvmev_clock.nsecs_skipped);
+}
+
+/* Host time it takes for the virtual clock to advance @nsecs */
+static inline unsigned long long nvmev_clock_to_host(unsigned long long nsecs)
+{
+	return nvmev_clock.scale > 1 ? div_u64(nsecs, nvmev_clock.scale) : nsecs;
+}
+
+/*
+ * I/O queues are partitioned over the dispatchers by qid. The admin queue and
+ * the BAR are always handled by dispatcher 0.
+ */
+static inline unsigned int nvmev_get_dispatcher(int qid)
+{
+	return (qid - 1) % nvmev_vdev->config.nr_dispatchers;
+}
+
+/*
+ * Doorbells of I/O queues. Once the host configures the doorbell buffer, it
+ * updates the shadow doorbells and skips the MMIO writes.
+ */
+static inline u32 *nvmev_io_dbs(void)
+{
+	u32 *dbbuf_dbs = smp_load_acquire(&nvmev_vdev->dbbuf_dbs);
+
+	return dbbuf_dbs ? dbbuf_dbs : (u32 *)nvmev_vdev->dbs;
+}
+
 void VDEV_FINALIZE(struct nvmev_dev *nvmev_vdev);
+void nvmev_quiesce_dispatchers(void);
 
 // OPS_PCI
 void nvmev_proc_bars(void);
@@ -295,12 +594,10 @@ void nvmev_proc_admin_sq(int new_db, int old_db);
 void nvmev_proc_admin_cq(int new_db, int old_db);
 
 // OPS I/O QUEUE
-struct buffer;
-void schedule_internal_operation(int sqid, unsigned long long nsecs_target,
-				struct buffer *write_buffer, size_t buffs_to_release);
 void NVMEV_IO_WORKER_INIT(struct nvmev_dev *nvmev_vdev);
 void NVMEV_IO_WORKER_FINAL(struct nvmev_dev *nvmev_vdev);
-int nvmev_proc_io_sq(int qid, int new_db, int old_db);
+void nvmev_quiesce_io_workers(void);
+int nvmev_proc_io_sq(int qid, int new_db, int old_db, int max_proc);
 void nvmev_proc_io_cq(int qid, int new_db, int old_db);
 
 #endif /* _LIB_NVMEV_H */
@@ -231,12 +231,17 @@ void nvmev_proc_bars(void)
 		/* Enable */
 		if (bar->cc.en == 1) {
 			if (nvmev_vdev->admin_q) {
+				nvmev_vdev->arb_wrr = (bar->cc.ams == 0x1);
 				bar->csts.rdy = 1;
 			} else {
 				WARN_ON("Enable device without init admin q");
 			}
 		} else if (bar->cc.en == 0) {
 			bar->csts.rdy = 0;
+
+			/* Doorbell buffer is configured again after the reset */
+			WRITE_ONCE(nvmev_vdev->dbbuf_dbs, NULL);
+			WRITE_ONCE(nvmev_vdev->dbbuf_eis, NULL);
 		}
 
 		/* Shutdown */
@@ -369,6 +374,7 @@ static void __init_nvme_ctrl_regs(struct pci_dev *dev)
 			.to = 1,
 			.mpsmin = 0,
 			.mqes = 1024 - 1, // 0-based value
+			.ams = 0x1, // Weighted round robin with urgent priority class
 #if (SUPPORTED_SSD_TYPE(ZNS))
 			.css = CAP_CSS_BIT_SPECIFIC,
 #endif
@@ -385,7 +391,7 @@ static struct pci_bus *__create_pci_bus(void)
 	struct pci_bus *bus = NULL;
 	struct pci_dev *dev;
 
-	nvmev_pci_sysdata.node = cpu_to_node(nvmev_vdev->config.cpu_nr_dispatcher);
+	nvmev_pci_sysdata.node = cpu_to_node(nvmev_vdev->config.cpu_nr_dispatchers[0]);
 
 	bus = pci_scan_bus(NVMEV_PCI_BUS_NUM, &nvmev_pci_ops, &nvmev_pci_sysdata);
 
@@ -427,6 +433,8 @@ static struct pci_bus *__create_pci_bus(void)
 struct nvmev_dev *VDEV_INIT(void)
 {
 	struct nvmev_dev *nvmev_vdev;
+	unsigned int i;
+
 	nvmev_vdev = kzalloc(sizeof(*nvmev_vdev), GFP_KERNEL);
 
 	nvmev_vdev->virtDev = kzalloc(PAGE_SIZE, GFP_KERNEL);
@@ -439,6 +447,12 @@ struct nvmev_dev *VDEV_INIT(void)
 
 	nvmev_vdev->admin_q = NULL;
 
+	/* No limit on the arbitration burst, as the dispatchers used to do */
+	nvmev_vdev->arb_burst = NVMEV_ARB_BURST_NO_LIMIT;
+
+	for (i = 0; i <= NR_MAX_IO_QUEUE; i++)
+		spin_lock_init(&nvmev_vdev->sq_qos_lock[i]);
+
 	return nvmev_vdev;
 }
 
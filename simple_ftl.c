@@ -5,11 +5,6 @@
 
 #include "simple_ftl.h"
 
-static inline unsigned long long __get_wallclock(void)
-{
-	return cpu_clock(nvmev_vdev->config.cpu_nr_dispatcher);
-}
-
 static size_t __cmd_io_size(struct nvme_rw_command *cmd)
 {
 	NVMEV_DEBUG_VERBOSE("[%c] %llu + %d, prp %llx %llx\n",
@@ -86,7 +81,7 @@ bool simple_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req,
 	case nvme_cmd_read:
 		ret->nsecs_target = __schedule_io_units(
 			cmd->common.opcode, cmd->rw.slba,
-			__cmd_io_size((struct nvme_rw_command *)cmd), __get_wallclock());
+			__cmd_io_size((struct nvme_rw_command *)cmd), nvmev_get_clock());
 		break;
 	case nvme_cmd_flush:
 		ret->nsecs_target = __schedule_flush(req);
@@ -100,8 +95,7 @@ bool simple_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req,
 	return true;
 }
 
-void simple_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-			   uint32_t cpu_nr_dispatcher)
+void simple_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr)
 {
 	ns->id = id;
 	ns->csi = NVME_CSI_NVM;
@@ -2,54 +2,159 @@
 
 #include <linux/ktime.h>
 #include <linux/sched/clock.h>
+#include <linux/atomic.h>
 
 #include "nvmev.h"
 #include "ssd.h"
 
-static inline uint64_t __get_ioclock(struct ssd *ssd)
+void buffer_init(struct buffer *buf, size_t size)
 {
-	return cpu_clock(ssd->cpu_nr_dispatcher);
+	buf->size = size;
+	atomic64_set(&buf->remaining, size);
+
+	spin_lock_init(&buf->timeline_lock);
+	buf->timeline = NULL;
+	buf->nr_timeline = 0;
+	buf->timeline_capacity = 0;
+	buf->nsecs_next_release = U64_MAX;
 }
 
-void buffer_init(struct buffer *buf, size_t size)
+void buffer_free(struct buffer *buf)
 {
-	spin_lock_init(&buf->lock);
-	buf->size = size;
-	buf->remaining = size;
+	kfree(buf->timeline);
+	buf->timeline = NULL;
+	buf->nr_timeline = buf->timeline_capacity = 0;
 }
 
-uint32_t buffer_allocate(struct buffer *buf, size_t size)
+static void __timeline_swap(struct buffer *buf, unsigned int a, unsigned int b)
+{
+	struct buffer_release tmp = buf->timeline[a];
+
+	buf->timeline[a] = buf->timeline[b];
+	buf->timeline[b] = tmp;
+}
+
+static void __timeline_push(struct buffer *buf, uint64_t nsecs, size_t size)
 {
-	while (!spin_trylock(&buf->lock)) {
-		cpu_relax();
+	unsigned int i = buf->nr_timeline++;
+
+	buf->timeline[i] = (struct buffer_release) { .nsecs = nsecs, .size = size };
+	while (i > 0 && buf->timeline[(i - 1) / 2].nsecs > buf->timeline[i].nsecs) {
+		__timeline_swap(buf, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void __timeline_pop(struct buffer *buf)
+{
+	unsigned int i = 0;
+
+	buf->timeline[0] = buf->timeline[--buf->nr_timeline];
+	while (true) {
+		unsigned int min = i;
+		unsigned int l = i * 2 + 1, r = i * 2 + 2;
+
+		if (l < buf->nr_timeline && buf->timeline[l].nsecs < buf->timeline[min].nsecs)
+			min = l;
+		if (r < buf->nr_timeline && buf->timeline[r].nsecs < buf->timeline[min].nsecs)
+			min = r;
+		if (min == i)
+			break;
+
+		__timeline_swap(buf, i, min);
+		i = min;
 	}
+}
+
+/* Give back the space of the writes programmed by now */
+static void __buffer_drain(struct buffer *buf)
+{
+	uint64_t nsecs;
+	size_t size = 0;
+
+	if (READ_ONCE(buf->nsecs_next_release) == U64_MAX)
+		return;
 
-	if (buf->remaining < size) {
-		size = 0;
+	nsecs = nvmev_get_clock();
+	if (READ_ONCE(buf->nsecs_next_release) > nsecs)
+		return;
+
+	spin_lock(&buf->timeline_lock);
+	while (buf->nr_timeline && buf->timeline[0].nsecs <= nsecs) {
+		size += buf->timeline[0].size;
+		__timeline_pop(buf);
 	}
+	WRITE_ONCE(buf->nsecs_next_release, buf->nr_timeline ? buf->timeline[0].nsecs : U64_MAX);
+	spin_unlock(&buf->timeline_lock);
+
+	if (size)
+		atomic64_add(size, &buf->remaining);
+}
+
+uint32_t buffer_allocate(struct buffer *buf, size_t size)
+{
+	s64 remaining;
+
+	__buffer_drain(buf);
+
+	remaining = atomic64_read(&buf->remaining);
 
-	buf->remaining -= size;
+	/* Reserve all of @size or nothing */
+	do {
+		if (remaining < (s64)size)
+			return 0;
+	} while (!atomic64_try_cmpxchg(&buf->remaining, &remaining, remaining - size));
 
-	spin_unlock(&buf->lock);
 	return size;
 }
 
 bool buffer_release(struct buffer *buf, size_t size)
 {
-	while (!spin_trylock(&buf->lock))
-		;
-	buf->remaining += size;
-	spin_unlock(&buf->lock);
+	atomic64_add(size, &buf->remaining);
 
 	return true;
 }
 
+/* Release @size bytes at @nsecs, when the data leaves the buffer for NAND */
+void buffer_release_at(struct buffer *buf, size_t size, uint64_t nsecs)
+{
+	spin_lock(&buf->timeline_lock);
+	if (buf->nr_timeline == buf->timeline_capacity) {
+		unsigned int capacity = max(buf->timeline_capacity * 2, 16U);
+		struct buffer_release *timeline =
+			krealloc(buf->timeline, sizeof(*timeline) * capacity, GFP_ATOMIC);
+
+		if (!timeline) {
+			/* Released earlier than modeled rather than leaked */
+			spin_unlock(&buf->timeline_lock);
+			buffer_release(buf, size);
+			return;
+		}
+		buf->timeline = timeline;
+		buf->timeline_capacity = capacity;
+	}
+
+	__timeline_push(buf, nsecs, size);
+	WRITE_ONCE(buf->nsecs_next_release, buf->timeline[0].nsecs);
+	spin_unlock(&buf->timeline_lock);
+}
+
+/* Whether @size bytes are likely to be allocated */
+bool buffer_available(struct buffer *buf, size_t size)
+{
+	__buffer_drain(buf);
+
+	return atomic64_read(&buf->remaining) >= (s64)size;
+}
+
 void buffer_refill(struct buffer *buf)
 {
-	while (!spin_trylock(&buf->lock))
-		;
-	buf->remaining = buf->size;
-	spin_unlock(&buf->lock);
+	/* The pending releases are covered by the refill */
+	spin_lock(&buf->timeline_lock);
+	buf->nr_timeline = 0;
+	WRITE_ONCE(buf->nsecs_next_release, U64_MAX);
+	atomic64_set(&buf->remaining, buf->size);
+	spin_unlock(&buf->timeline_lock);
 }
 
 static void check_params(struct ssdparams *spp)
@@ -290,7 +395,7 @@ static void ssd_remove_pcie(struct ssd_pcie *pcie)
 	kfree(pcie->perf_model);
 }
 
-void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher)
+void ssd_init(struct ssd *ssd, struct ssdparams *spp)
 {
 	uint32_t i;
 	/* copy spp */
@@ -302,9 +407,6 @@ void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher
 		ssd_init_ch(&(ssd->ch[i]), spp);
 	}
 
-	/* Set CPU number to use same cpuclock as io.c */
-	ssd->cpu_nr_dispatcher = cpu_nr_dispatcher;
-
 	ssd->pcie = kmalloc(sizeof(struct ssd_pcie), GFP_KERNEL);
 	ssd_init_pcie(ssd->pcie, spp);
 
@@ -318,6 +420,8 @@ void ssd_remove(struct ssd *ssd)
 {
 	uint32_t i;
 
+	if (ssd->write_buffer)
+		buffer_free(ssd->write_buffer);
 	kfree(ssd->write_buffer);
 	if (ssd->pcie) {
 		kfree(ssd->pcie->perf_model);
@@ -360,7 +464,7 @@ uint64_t ssd_advance_write_buffer(struct ssd *ssd, uint64_t request_time, uint64
 uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 {
 	int c = ncmd->cmd;
-	uint64_t cmd_stime = (ncmd->stime == 0) ? __get_ioclock(ssd) : ncmd->stime;
+	uint64_t cmd_stime = (ncmd->stime == 0) ? nvmev_get_clock() : ncmd->stime;
 	uint64_t nand_stime, nand_etime;
 	uint64_t chnl_stime, chnl_etime;
 	uint64_t remaining, xfer_size, completed_time;
@@ -455,7 +559,7 @@ uint64_t ssd_next_idle_time(struct ssd *ssd)
 {
 	struct ssdparams *spp = &ssd->sp;
 	uint32_t i, j;
-	uint64_t latest = __get_ioclock(ssd);
+	uint64_t latest = nvmev_get_clock();
 
 	for (i = 0; i < spp->nchs; i++) {
 		struct ssd_channel *ch = &ssd->ch[i];
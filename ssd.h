@@ -131,10 +131,25 @@ struct nand_cmd {
 	struct ppa *ppa;
 };
 
+struct buffer_release {
+	uint64_t nsecs;
+	size_t size;
+};
+
+/* Space is reserved and released with atomic operations on @remaining */
 struct buffer {
 	size_t size;
-	size_t remaining;
-	spinlock_t lock;
+	atomic64_t remaining;
+
+	/*
+	 * Releases to happen once the data is programmed, as a min-heap on
+	 * nsecs. Drained lazily when the buffer is allocated or checked.
+	 */
+	spinlock_t timeline_lock;
+	struct buffer_release *timeline;
+	unsigned int nr_timeline;
+	unsigned int timeline_capacity;
+	uint64_t nsecs_next_release; /* U64_MAX if @timeline is empty */
 };
 
 /*
@@ -215,7 +230,6 @@ struct ssd {
 	struct ssd_channel *ch;
 	struct ssd_pcie *pcie;
 	struct buffer *write_buffer;
-	unsigned int cpu_nr_dispatcher;
 };
 
 static inline struct ssd_channel *get_ch(struct ssd *ssd, struct ppa *ppa)
@@ -254,7 +268,7 @@ static inline uint32_t get_cell(struct ssd *ssd, struct ppa *ppa)
 }
 
 void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts);
-void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher);
+void ssd_init(struct ssd *ssd, struct ssdparams *spp);
 void ssd_remove(struct ssd *ssd);
 
 uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd);
@@ -263,8 +277,11 @@ uint64_t ssd_advance_write_buffer(struct ssd *ssd, uint64_t request_time, uint64
 uint64_t ssd_next_idle_time(struct ssd *ssd);
 
 void buffer_init(struct buffer *buf, size_t size);
+void buffer_free(struct buffer *buf);
 uint32_t buffer_allocate(struct buffer *buf, size_t size);
 bool buffer_release(struct buffer *buf, size_t size);
+void buffer_release_at(struct buffer *buf, size_t size, uint64_t nsecs);
+bool buffer_available(struct buffer *buf, size_t size);
 void buffer_refill(struct buffer *buf);
 
 void adjust_ftl_latency(int target, int lat);
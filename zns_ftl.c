@@ -52,6 +52,16 @@ static void __init_descriptor(struct zns_ftl *zns_ftl)
 
 static void __remove_descriptor(struct zns_ftl *zns_ftl)
 {
+	uint32_t i;
+
+	for (i = 0; i < zns_ftl->zp.nr_zones; i++) {
+		if (zns_ftl->zp.zrwa_buffer_size)
+			buffer_free(&zns_ftl->zwra_buffer[i]);
+
+		if (zns_ftl->zp.zone_wb_size)
+			buffer_free(&zns_ftl->zone_write_buffer[i]);
+	}
+
 	if (zns_ftl->zp.zrwa_buffer_size)
 		kfree(zns_ftl->zwra_buffer);
 
@@ -121,8 +131,7 @@ static void zns_init_ftl(struct zns_ftl *zns_ftl, struct znsparams *zpp, struct
 	__init_resource(zns_ftl);
 }
 
-void zns_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
-			uint32_t cpu_nr_dispatcher)
+void zns_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr)
 {
 	struct ssd *ssd;
 	struct zns_ftl *zns_ftl;
@@ -135,7 +144,7 @@ void zns_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *m
 
 	ssd = kmalloc(sizeof(struct ssd), GFP_KERNEL);
 	ssd_init_params(&spp, size, nr_parts);
-	ssd_init(ssd, &spp, cpu_nr_dispatcher);
+	ssd_init(ssd, &spp);
 
 	zns_ftl = kmalloc(sizeof(struct zns_ftl) * nr_parts, GFP_KERNEL);
 	zns_init_params(&zpp, &spp, size);
@@ -174,7 +183,7 @@ static void zns_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nvm
 	uint32_t i;
 	struct zns_ftl *zns_ftl = (struct zns_ftl *)ns->ftls;
 
-	start = local_clock();
+	start = nvmev_get_clock();
 	latest = start;
 	for (i = 0; i < ns->nr_parts; i++) {
 		latest = max(latest, ssd_next_idle_time(zns_ftl[i].ssd));
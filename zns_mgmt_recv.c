@@ -3,72 +3,13 @@
 #include <linux/kthread.h>
 #include <linux/jiffies.h>
 #include <linux/ktime.h>
-#include <linux/highmem.h>
 #include <linux/sched/clock.h>
 
 #include "nvmev.h"
 #include "ssd.h"
 #include "zns_ftl.h"
-
-static uint64_t __prp_transfer_data(uint64_t prp1, uint64_t prp2, void *buffer, uint64_t length,
-				    uint32_t io)
-{
-	size_t offset;
-	size_t remaining;
-	size_t prp_offs = 0;
-	size_t prp2_offs = 0;
-	uint64_t paddr;
-	uint64_t *paddr_list = NULL;
-	size_t mem_offs = 0;
-
-	offset = 0;
-	remaining = length;
-
-	while (remaining) {
-		size_t io_size;
-		void *vaddr;
-
-		mem_offs = 0;
-		prp_offs++;
-		if (prp_offs == 1) {
-			paddr = prp1;
-		} else if (prp_offs == 2) {
-			paddr = prp2;
-			if (remaining > PAGE_SIZE) {
-				paddr_list = kmap_atomic_pfn(PRP_PFN(paddr)) +
-					     (paddr & PAGE_OFFSET_MASK);
-				paddr = paddr_list[prp2_offs++];
-			}
-		} else {
-			paddr = paddr_list[prp2_offs++];
-		}
-
-		vaddr = kmap_atomic_pfn(PRP_PFN(paddr));
-
-		io_size = min_t(size_t, remaining, PAGE_SIZE);
-
-		if (paddr & PAGE_OFFSET_MASK) {
-			mem_offs = paddr & PAGE_OFFSET_MASK;
-			if (io_size + mem_offs > PAGE_SIZE)
-				io_size = PAGE_SIZE - mem_offs;
-		}
-
-		if (io == 0) // output (buffer -> prp)
-			memcpy(vaddr + mem_offs, buffer + offset, io_size);
-		else // input (prp -> buffer)
-			memcpy(buffer + offset, vaddr + mem_offs, io_size);
-
-		kunmap_atomic(vaddr);
-
-		remaining -= io_size;
-		offset += io_size;
-	}
-
-	if (paddr_list != NULL)
-		kunmap_atomic(paddr_list);
-
-	return length;
-}
+#include "dptr.h"
+#include "copy.h"
 
 static void __fill_zone_report(struct zns_ftl *zns_ftl, struct nvme_zone_mgmt_recv *cmd,
 			       struct zone_report *report)
@@ -84,7 +25,9 @@ static void __fill_zone_report(struct zns_ftl *zns_ftl, struct nvme_zone_mgmt_re
 	if (cmd->zra_specific_features == 0) // all
 		nr_zone_to_report = zns_ftl->zp.nr_zones - start_zid;
 	else // partial. # of zone desc transferred
-		nr_zone_to_report = (bytes_transfer / sizeof(struct zone_descriptor)) - 1;
+		nr_zone_to_report = min_t(uint64_t,
+					  (bytes_transfer / sizeof(struct zone_descriptor)) - 1,
+					  zns_ftl->zp.nr_zones - start_zid);
 
 	report->nr_zones = nr_zone_to_report;
 
@@ -131,8 +74,14 @@ void zns_zmgmt_recv(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev
 	if (__check_zmgmt_rcv_option_supported(zns_ftl, cmd)) {
 		__fill_zone_report(zns_ftl, cmd, buffer);
 
-		__prp_transfer_data(prp1, prp2, buffer, length, 0);
-		status = NVME_SC_SUCCESS;
+		/*
+		 * The data pointer may be PRPs, chained PRP lists, or an SGL. The
+		 * host buffer may be sized after MDTS; copy no more than the report.
+		 */
+		length = min_t(uint64_t, length,
+			       sizeof(struct zone_report) +
+				       sizeof(struct zone_descriptor) * buffer->nr_zones);
+		status = nvmev_dptr_copy(cmd->flags, prp1, prp2, buffer, length, NVMEV_COPY_READ);
 	} else {
 		status = NVME_SC_INVALID_FIELD;
 	}
@@ -101,8 +101,11 @@ static bool __zns_write(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 	else
 		write_buffer = zns_ftl->ssd->write_buffer;
 
-	if (buffer_allocate(write_buffer, LBA_TO_BYTE(nr_lba)) < LBA_TO_BYTE(nr_lba))
+	if (buffer_allocate(write_buffer, LBA_TO_BYTE(nr_lba)) < LBA_TO_BYTE(nr_lba)) {
+		ret->wait_buffer = write_buffer;
+		ret->wait_size = LBA_TO_BYTE(nr_lba);
 		return false;
+	}
 
 	if ((LBA_TO_BYTE(nr_lba) % spp->write_unit_size) != 0) {
 		status = NVME_SC_ZNS_INVALID_WRITE;
@@ -206,8 +209,7 @@ static bool __zns_write(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 			else
 				bufs_to_release = spp->pgs_per_oneshotpg * spp->pgsz;
 
-			schedule_internal_operation(req->sq_id, nsecs_completed, write_buffer,
-						    bufs_to_release);
+			buffer_release_at(write_buffer, bufs_to_release, nsecs_completed);
 		}
 	}
 
@@ -255,9 +257,9 @@ static bool __zns_write_zrwa(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 	uint64_t nr_lbas_flush = 0, lpn, remaining, pgs = 0, pg_off;
 
 	NVMEV_DEBUG(
-		"%s slba 0x%llx nr_lba 0x%llx zone_id %d state %d wp 0x%llx zrwa_impl_start 0x%llx zrwa_impl_end 0x%llx  buffer %lu\n",
+		"%s slba 0x%llx nr_lba 0x%llx zone_id %d state %d wp 0x%llx zrwa_impl_start 0x%llx zrwa_impl_end 0x%llx  buffer %lld\n",
 		__func__, slba, nr_lba, zid, state, prev_wp, zrwa_impl_start, zrwa_impl_end,
-		zns_ftl->zwra_buffer[zid].remaining);
+		atomic64_read(&zns_ftl->zwra_buffer[zid].remaining));
 
 	if ((LBA_TO_BYTE(nr_lba) % spp->write_unit_size) != 0) {
 		status = NVME_SC_ZNS_INVALID_WRITE;
@@ -316,21 +318,24 @@ static bool __zns_write_zrwa(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 		nr_lbas_flush = DIV_ROUND_UP((elba - zrwa_impl_start + 1), lbas_per_zrwafg) *
 				lbas_per_zrwafg;
 
-		NVMEV_DEBUG("%s implicitly flush zid %d wp before 0x%llx after 0x%llx buffer %lu",
+		NVMEV_DEBUG("%s implicitly flush zid %d wp before 0x%llx after 0x%llx buffer %lld",
 			    __func__, zid, prev_wp, zone_descs[zid].wp + nr_lbas_flush,
-			    zns_ftl->zwra_buffer[zid].remaining);
+			    atomic64_read(&zns_ftl->zwra_buffer[zid].remaining));
 	} else if (elba == zone_to_elba(zns_ftl, zid)) {
 		// Workaround. move wp to end of the zone and make state full implicitly
 		nr_lbas_flush = elba - prev_wp + 1;
 
-		NVMEV_DEBUG("%s end of zone zid %d wp before 0x%llx after 0x%llx buffer %lu",
+		NVMEV_DEBUG("%s end of zone zid %d wp before 0x%llx after 0x%llx buffer %lld",
 			    __func__, zid, prev_wp, zone_descs[zid].wp + nr_lbas_flush,
-			    zns_ftl->zwra_buffer[zid].remaining);
+			    atomic64_read(&zns_ftl->zwra_buffer[zid].remaining));
 	}
 
 	if (nr_lbas_flush > 0) {
-		if (!buffer_allocate(&zns_ftl->zwra_buffer[zid], LBA_TO_BYTE(nr_lbas_flush)))
+		if (!buffer_allocate(&zns_ftl->zwra_buffer[zid], LBA_TO_BYTE(nr_lbas_flush))) {
+			ret->wait_buffer = &zns_ftl->zwra_buffer[zid];
+			ret->wait_size = LBA_TO_BYTE(nr_lbas_flush);
 			return false;
+		}
 
 		__increase_write_ptr(zns_ftl, zid, nr_lbas_flush);
 	}
@@ -358,9 +363,8 @@ static bool __zns_write_zrwa(struct zns_ftl *zns_ftl, struct nvmev_request *req,
 			nsecs_completed = ssd_advance_nand(zns_ftl->ssd, &swr);
 			nsecs_latest = max(nsecs_completed, nsecs_latest);
 
-			schedule_internal_operation(req->sq_id, nsecs_completed,
-						    &zns_ftl->zwra_buffer[zid],
-						    spp->pgs_per_oneshotpg * spp->pgsz);
+			buffer_release_at(&zns_ftl->zwra_buffer[zid], spp->pgs_per_oneshotpg * spp->pgsz,
+					  nsecs_completed);
 		}
 
 		lpn += pgs;